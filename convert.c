@@ -0,0 +1,478 @@
+// テキストのdouble列とバイナリのdouble列を相互に変換する
+// (writebinaryfile.c が書く形式: テキストは 個数 と1行に1つの "%f"、バイナリは size_t の個数 と double の列)
+//
+// コンパイル: gcc -O2 -pthread convert.c -lm
+// 使い方:
+//  convert [-t threads] [-b buffer KB] tobin <txt filename> <binary filename>
+//  convert [-t threads] [-b buffer KB] totext <binary filename> <txt filename>
+//
+// readbinary.c の fscanf("%lf") や writebinaryfile.c の fprintf("%f") を1つずつ呼ぶ代わりに、
+//  読むファイルはmmapし、数は自前の関数で読み書きする。
+//  読むとき: 仮数が2^53以下・10の指数が22以下なら 仮数 x 10^指数 (または ÷) で正しく丸まるのでそのまま計算し、
+//   それ以外 (桁が多い, inf/nan, 16進など) だけ strtod を呼ぶ。
+//  書くとき: double は 仮数 x 2^指数 なので、x 10^6 を128ビットの整数で正確に計算して "%f" と同じ6桁に丸める
+//   (ちょうど半分のときは偶数に丸める。printfと同じ)。整数部が64ビットに入らないときだけ snprintf を使う。
+//  ファイルをスレッド数のかたまりに分けて並列に変換し、かたまりの順に書き出す。かかった時間とMB/sを表示する
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h> // getopt
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include "mapfile.h"
+
+// 書き出すときにスレッドが一度に受け持つ数の個数
+#define FORMAT_BLOCK 262144
+// 1つの数を "%f" で書いたときの長さの上限 (これより長くなるのは snprintf に任せる巨大な数だけ)
+#define FIXED_MAX 48
+
+// テキスト→バイナリの1スレッド分の仕事
+typedef struct
+{
+  const char *begin; // 受け持つ範囲 (数の途中では切らない)
+  const char *end;
+  size_t count;      // 範囲の中の数の個数 (1回目に数える)
+  double *out;       // 2回目に書き込む先
+  const char *error; // 読めなかった位置 (なければNULL)
+} ParseTask;
+
+// バイナリ→テキストの1スレッド分の仕事
+typedef struct
+{
+  const double *in;
+  size_t count;
+  char *buf;  // count * FIXED_MAX バイト (snprintf に回した巨大な数の分は別に足す)
+  size_t cap;
+  size_t len; // 書いたバイト数
+} FormatTask;
+
+int load_int(const char *argvalue);
+const char *parse_double(const char *p, const char *end, double *out);
+size_t format_fixed(char *q, size_t room, double x);
+
+int load_int(const char *argvalue)
+{
+  long nl;
+  char *e;
+  errno = 0; // errno.h で定義されているグローバル変数を一旦初期化
+  nl = strtol(argvalue,&e,10);
+  if (errno == ERANGE){
+    fprintf(stderr,"%s: %s\n",argvalue,strerror(errno));
+    exit(1);
+  }
+  if (*e != '\0'){
+    fprintf(stderr,"%s: an irregular character '%c' is detected.\n",argvalue,*e);
+    exit(1);
+  }
+  return (int)nl;
+}
+
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int is_space(char c)
+{
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static int is_digit(char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+// 10^0 〜 10^22 は double で正確に表せる
+static const double pow10_exact[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// p から始まる数を1つ読み、*out に入れて数の直後を返す。読めなければNULL
+//  数は空白で区切られている (end を越えては読まない)
+const char *parse_double(const char *p, const char *end, double *out)
+{
+  const char *start = p;
+  const char *q = p;
+  int negative = 0;
+  if (q < end && (*q == '-' || *q == '+')) negative = (*q++ == '-');
+  uint64_t m = 0;
+  int digits = 0;   // mに入れた桁数 (先頭の0は数えない)
+  int exp10 = 0;
+  int exact = 1;    // 落とした桁がない
+  int any = 0;
+  for ( ; q < end && is_digit(*q) ; q++){
+    any = 1;
+    if (digits < 19){
+      m = m * 10 + (*q - '0');
+      if (m > 0) digits++;
+    } else {
+      exp10++;
+      if (*q != '0') exact = 0;
+    }
+  }
+  if (q < end && *q == '.'){
+    for (q++ ; q < end && is_digit(*q) ; q++){
+      any = 1;
+      if (digits < 19){
+        m = m * 10 + (*q - '0');
+        if (m > 0) digits++;
+        exp10--;
+      } else if (*q != '0') exact = 0;
+    }
+  }
+  if (any && q < end && (*q == 'e' || *q == 'E')){
+    const char *r = q + 1;
+    int eneg = 0;
+    if (r < end && (*r == '-' || *r == '+')) eneg = (*r++ == '-');
+    if (r < end && is_digit(*r)){
+      int e = 0;
+      for ( ; r < end && is_digit(*r) ; r++) if (e < 100000) e = e * 10 + (*r - '0');
+      exp10 += eneg ? -e : e;
+      q = r;
+    }
+  }
+  if (any && exact && (q == end || is_space(*q)) && m <= ((uint64_t)1 << 53) && exp10 >= -22 && exp10 <= 22){
+    // Clinger の高速な場合: m も 10^|exp10| も正確なので、1回の乗除算で正しく丸まる
+    const double v = (exp10 >= 0) ? (double)m * pow10_exact[exp10] : (double)m / pow10_exact[-exp10];
+    *out = negative ? -v : v;
+    return q;
+  }
+
+  // それ以外は strtod に任せる (NULで終わる文字列にしてから)
+  const char *t = start;
+  while (t < end && !is_space(*t)) t++;
+  const size_t len = (size_t)(t - start);
+  if (len == 0) return NULL;
+  char small[128];
+  char *tmp = (len < sizeof(small)) ? small : (char*)malloc(len + 1);
+  memcpy(tmp, start, len);
+  tmp[len] = '\0';
+  char *e;
+  *out = strtod(tmp, &e);
+  const int ok = (e == tmp + len);
+  if (tmp != small) free(tmp);
+  return ok ? t : NULL;
+}
+
+// x を "%f" と同じ文字列にして q に書き、長さを返す (NULは書かない)。room が足りなければ0を返す
+size_t format_fixed(char *q, size_t room, double x)
+{
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  const int negative = (int)(bits >> 63);
+  const int biased = (int)((bits >> 52) & 0x7ff);
+  uint64_t mant = bits & (((uint64_t)1 << 52) - 1);
+  int e2;
+  if (biased == 0x7ff) goto fallback; // inf, nan
+  if (biased == 0){
+    e2 = -1074; // 非正規化数
+  } else {
+    mant |= (uint64_t)1 << 52;
+    e2 = biased - 1075;
+  }
+  // x = mant x 2^e2。x 10^6 を丸めた整数 scaled を求める
+  uint64_t int_part, frac_part;
+  if (e2 >= 0){
+    if (e2 > 10) goto fallback; // 整数部が64ビットを超えるかもしれない
+    int_part = mant << e2;
+    frac_part = 0;
+  } else {
+    const unsigned __int128 p = (unsigned __int128)mant * 1000000u; // < 2^73
+    const int s = -e2;
+    unsigned __int128 scaled;
+    if (s >= 127){
+      scaled = 0; // p < 2^73 <= 2^(s-1) なので必ず切り捨て
+    } else {
+      scaled = p >> s;
+      const unsigned __int128 rem = p - (scaled << s);
+      const unsigned __int128 half = (unsigned __int128)1 << (s - 1);
+      if (rem > half || (rem == half && (scaled & 1))) scaled++;
+    }
+    int_part = (uint64_t)(scaled / 1000000u);
+    frac_part = (uint64_t)(scaled % 1000000u);
+  }
+  char digits[24];
+  int nd = 0;
+  do {
+    digits[nd++] = (char)('0' + int_part % 10);
+    int_part /= 10;
+  } while (int_part > 0);
+  const size_t len = (size_t)(negative + nd + 7);
+  if (len > room) return 0;
+  size_t k = 0;
+  if (negative) q[k++] = '-';
+  while (nd > 0) q[k++] = digits[--nd];
+  q[k++] = '.';
+  for (int i = 5 ; i >= 0 ; i--){
+    q[k + i] = (char)('0' + frac_part % 10);
+    frac_part /= 10;
+  }
+  return k + 6;
+
+fallback: {
+    const int n = snprintf(NULL, 0, "%f", x);
+    if (n < 0 || (size_t)n + 1 > room) return 0;
+    snprintf(q, room, "%f", x);
+    return (size_t)n;
+  }
+}
+
+// 範囲の中の数を数える (空白でない文字の並びの数)
+static void *count_worker(void *arg)
+{
+  ParseTask *t = (ParseTask*)arg;
+  size_t count = 0;
+  int in_token = 0;
+  for (const char *p = t->begin ; p < t->end ; p++){
+    const int sp = is_space(*p);
+    if (!sp && !in_token) count++;
+    in_token = !sp;
+  }
+  t->count = count;
+  return NULL;
+}
+
+static void *parse_worker(void *arg)
+{
+  ParseTask *t = (ParseTask*)arg;
+  const char *p = t->begin;
+  size_t k = 0;
+  t->error = NULL;
+  while (1){
+    while (p < t->end && is_space(*p)) p++;
+    if (p >= t->end) break;
+    const char *next = parse_double(p, t->end, &t->out[k]);
+    if (next == NULL){
+      t->error = p;
+      return NULL;
+    }
+    k++;
+    p = next;
+  }
+  return NULL;
+}
+
+static void *format_worker(void *arg)
+{
+  FormatTask *t = (FormatTask*)arg;
+  size_t len = 0;
+  for (size_t i = 0 ; i < t->count ; i++){
+    size_t w;
+    while ((w = format_fixed(t->buf + len, t->cap - len - 1, t->in[i])) == 0){
+      // 巨大な数で足りなくなったら広げる
+      t->cap *= 2;
+      t->buf = (char*)realloc(t->buf, t->cap);
+      if (t->buf == NULL){
+        fprintf(stderr, "cannot allocate the text buffer.\n");
+        exit(1);
+      }
+    }
+    len += w;
+    t->buf[len++] = '\n';
+  }
+  t->len = len;
+  return NULL;
+}
+
+// T個のスレッドで worker を走らせる (T == 1 ならそのまま呼ぶ)
+static void run_threads(void *(*worker)(void*), void *tasks, size_t task_size, int T)
+{
+  if (T == 1){
+    worker(tasks);
+    return;
+  }
+  pthread_t *tid = (pthread_t*)malloc(sizeof(pthread_t) * T);
+  for (int t = 0 ; t < T ; t++){
+    if (pthread_create(&tid[t], NULL, worker, (char*)tasks + task_size * t) != 0){
+      fprintf(stderr, "cannot create a thread.\n");
+      exit(1);
+    }
+  }
+  for (int t = 0 ; t < T ; t++) pthread_join(tid[t], NULL);
+  free(tid);
+}
+
+static FILE *open_output(const char *filename, size_t buffer)
+{
+  FILE *fp;
+  if ((fp = fopen(filename, "wb")) == NULL){
+    fprintf(stderr, "%s: cannot open file.\n", filename);
+    exit(1);
+  }
+  setvbuf(fp, NULL, _IOFBF, buffer);
+  return fp;
+}
+
+static void close_output(FILE *fp, const char *filename)
+{
+  if (ferror(fp) || fclose(fp) != 0){
+    fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+    exit(1);
+  }
+}
+
+// テキスト → バイナリ
+static void to_binary(const char *txt, const char *bin, int T, size_t buffer)
+{
+  const double start = now_sec();
+  MappedFile m = map_file(txt);
+  const char *p = (const char*)m.addr;
+  const char *end = p + m.size;
+  // 先頭は個数
+  while (p < end && is_space(*p)) p++;
+  char *e;
+  char head[32];
+  size_t hl = 0;
+  while (p + hl < end && !is_space(p[hl]) && hl < sizeof(head) - 1){
+    head[hl] = p[hl];
+    hl++;
+  }
+  head[hl] = '\0';
+  errno = 0;
+  const unsigned long long declared = strtoull(head, &e, 10);
+  if (hl == 0 || *e != '\0' || errno == ERANGE){
+    fprintf(stderr, "%s: the first token must be the number of values.\n", txt);
+    exit(1);
+  }
+  p += hl;
+
+  // 空白のところで T 個に分ける
+  ParseTask *tasks = (ParseTask*)calloc(T, sizeof(ParseTask));
+  const char *cut = p;
+  for (int t = 0 ; t < T ; t++){
+    const char *stop = (t == T - 1) ? end : p + (size_t)(end - p) * (t + 1) / T;
+    if (stop < cut) stop = cut;
+    while (stop < end && !is_space(*stop)) stop++;
+    tasks[t].begin = cut;
+    tasks[t].end = stop;
+    cut = stop;
+  }
+  run_threads(count_worker, tasks, sizeof(ParseTask), T);
+  size_t total = 0;
+  for (int t = 0 ; t < T ; t++) total += tasks[t].count;
+  if (total != declared){
+    fprintf(stderr, "%s: the header says %llu values but the file has %zu.\n", txt, declared, total);
+    exit(1);
+  }
+  double *d = (double*)malloc(sizeof(double) * (total > 0 ? total : 1));
+  if (d == NULL){
+    fprintf(stderr, "cannot allocate %zu values.\n", total);
+    exit(1);
+  }
+  size_t offset = 0;
+  for (int t = 0 ; t < T ; t++){
+    tasks[t].out = d + offset;
+    offset += tasks[t].count;
+  }
+  run_threads(parse_worker, tasks, sizeof(ParseTask), T);
+  for (int t = 0 ; t < T ; t++){
+    if (tasks[t].error != NULL){
+      fprintf(stderr, "%s: cannot read a number at byte %td.\n", txt, tasks[t].error - (const char*)m.addr);
+      exit(1);
+    }
+  }
+
+  FILE *fp = open_output(bin, buffer);
+  fwrite(&total, sizeof(size_t), 1, fp);
+  fwrite(d, sizeof(double), total, fp);
+  close_output(fp, bin);
+  const double sec = now_sec() - start;
+  const double mb = m.size / 1048576.0;
+  fprintf(stderr, "text -> binary: %zu values, %.1f MB of text in %.3f s (%.1f MB/s)\n",
+          total, mb, sec, (sec > 0) ? mb / sec : 0.0);
+  free(d);
+  free(tasks);
+  unmap_file(&m);
+}
+
+// バイナリ → テキスト
+static void to_text(const char *bin, const char *txt, int T, size_t buffer)
+{
+  const double start = now_sec();
+  MappedFile m = map_file(bin);
+  size_t count;
+  if (m.size < sizeof(size_t)){
+    fprintf(stderr, "%s: too short (%zu bytes).\n", bin, m.size);
+    exit(1);
+  }
+  memcpy(&count, m.addr, sizeof(size_t));
+  if ((m.size - sizeof(size_t)) / sizeof(double) != count || (m.size - sizeof(size_t)) % sizeof(double) != 0){
+    fprintf(stderr, "%s: the header says %zu values but the file has %zu bytes.\n", bin, count, m.size);
+    exit(1);
+  }
+  const double *d = (const double*)((const char*)m.addr + sizeof(size_t));
+
+  FILE *fp = open_output(txt, buffer);
+  fprintf(fp, "%zu\n", count);
+  FormatTask *tasks = (FormatTask*)calloc(T, sizeof(FormatTask));
+  for (int t = 0 ; t < T ; t++){
+    tasks[t].cap = (size_t)FORMAT_BLOCK * (FIXED_MAX + 1);
+    tasks[t].buf = (char*)malloc(tasks[t].cap);
+  }
+  size_t bytes = 0;
+  // T 個のかたまりを並列に文字列にして、順に書き出すのを繰り返す
+  for (size_t base = 0 ; base < count ; base += (size_t)FORMAT_BLOCK * T){
+    for (int t = 0 ; t < T ; t++){
+      const size_t first = base + (size_t)FORMAT_BLOCK * t;
+      tasks[t].in = d + first;
+      tasks[t].count = (first >= count) ? 0 : (count - first < FORMAT_BLOCK) ? count - first : FORMAT_BLOCK;
+    }
+    run_threads(format_worker, tasks, sizeof(FormatTask), T);
+    for (int t = 0 ; t < T ; t++){
+      fwrite(tasks[t].buf, 1, tasks[t].len, fp);
+      bytes += tasks[t].len;
+    }
+  }
+  close_output(fp, txt);
+  const double sec = now_sec() - start;
+  const double mb = bytes / 1048576.0;
+  fprintf(stderr, "binary -> text: %zu values, %.1f MB of text in %.3f s (%.1f MB/s)\n",
+          count, mb, sec, (sec > 0) ? mb / sec : 0.0);
+  for (int t = 0 ; t < T ; t++) free(tasks[t].buf);
+  free(tasks);
+  unmap_file(&m);
+}
+
+int main(int argc, char **argv)
+{
+  const char *usage = "usage: %s [-t threads] [-b buffer KB] tobin <txt filename> <binary filename>\n"
+                      "       %s [-t threads] [-b buffer KB] totext <binary filename> <txt filename>\n";
+  int threads = 1;
+  size_t buffer = (size_t)1 << 20; // 書き出しのバッファ (既定 1MB)
+  int opt;
+  while ((opt = getopt(argc, argv, "t:b:")) != -1){
+    switch (opt){
+    case 't':
+      threads = load_int(optarg);
+      assert( threads > 0 );
+      break;
+    case 'b':
+      buffer = (size_t)load_int(optarg) << 10;
+      assert( buffer > 0 );
+      break;
+    default:
+      fprintf(stderr, usage, argv[0], argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind != 3){
+    fprintf(stderr, usage, argv[0], argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (strcmp(argv[optind], "tobin") == 0){
+    to_binary(argv[optind + 1], argv[optind + 2], threads, buffer);
+  } else if (strcmp(argv[optind], "totext") == 0){
+    to_text(argv[optind + 1], argv[optind + 2], threads, buffer);
+  } else {
+    fprintf(stderr, usage, argv[0], argv[0]);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
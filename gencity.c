@@ -1,11 +1,95 @@
 // generate a binary data for cities (TSP)
 // the first int means the number of cities
-// the following values are x_0, y_0, 
+// the following values are x_0, y_0,
+//
+// コンパイル: gcc -O2 -pthread gencity.c -lm
+// オプションを付けなければ従来どおり (rand(), 70x40 の地図の中, 100都市まで)。
+// -d/-x/-y/-c/-t を付けると、数千万都市まで固定長のかたまり(CHUNK都市)ごとに作って書き出す
+// -f v1 を付けると、バージョン付きの形式 (mapfile.h, CRCと生成条件のメタデータ付き) で書く
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h> // strerror()
 #include <errno.h> // errno, ERANGE
 #include <assert.h> // assert()
+#include <unistd.h> // getopt
+#include <math.h> // sqrt, log, cos
+#include <time.h> // clock_gettime
+#include <pthread.h>
+#include "mapfile.h"
+
+// 1つのかたまりの都市数 (x, y で 512KB)
+#define CHUNK 65536
+
+// 町の置き方 (-d オプション)
+typedef enum
+{
+  DIST_LEGACY,  // 従来の置き方
+  DIST_UNIFORM, // 範囲の中に一様に置く
+  DIST_CLUSTER, // いくつかの中心のまわりに正規分布で集める
+  DIST_GRID,    // 格子点に並べる (乱数は使わない)
+} Distribution;
+
+typedef struct
+{
+  Distribution dist;
+  int max_x;    // x座標は 0以上max_x未満
+  int max_y;
+  int clusters; // DIST_CLUSTER の中心の数
+  int threads;
+  uint64_t seed;
+} GenConfig;
+
+// xorshift64* (tsp.c と同じ)。かたまりごとに別のストリームにするので、
+// スレッド数を変えても同じseedなら同じファイルになる
+typedef struct
+{
+  uint64_t s;
+} Rng;
+
+typedef struct
+{
+  int x;
+  int y;
+} Point;
+
+// 生成器の状態 (全スレッドで共有し、読むだけ)
+typedef struct
+{
+  const GenConfig *conf;
+  int nc;
+  int grid_side;         // DIST_GRID の1辺の点の数
+  const Point *centers;  // DIST_CLUSTER の中心
+  double sigma;          // DIST_CLUSTER の広がり
+} Generator;
+
+// 書き出し先 (従来の形式かバージョン付きの形式か)
+typedef struct
+{
+  FILE *fp;
+  int versioned;
+  BinHeader header;
+  uint32_t crc;
+} Output;
+
+// 1スレッド分の仕事: chunk番目のかたまりを作る
+typedef struct
+{
+  const Generator *gen;
+  int *buf;        // かたまり1つ分 (x, y, x, y, ...)
+  long long chunk; // 今回作るかたまりの番号 (なければ -1)
+} GenTask;
+
+int load_int(const char *argvalue);
+Rng rng_init(uint64_t seed, uint64_t stream);
+uint64_t rng_next(Rng *r);
+int rng_int(Rng *r, int m);
+double rng_normal(Rng *r);
+void generate_chunk(const Generator *gen, long long chunk, int *buf);
+int begin_output(Output *out, int nc, const char *meta);
+int write_cities(Output *out, const int *data, size_t m);
+int finish_output(Output *out);
+int write_legacy(int nc, int seed, Output *out);
 
 int load_int(const char *argvalue)
 {
@@ -24,20 +108,115 @@ int load_int(const char *argvalue)
   return (int)nl;
 }
 
+Rng rng_init(uint64_t seed, uint64_t stream)
+{
+  uint64_t z = seed + 0x9E3779B97F4A7C15ull * (stream + 1);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  z ^= z >> 31;
+  return (Rng){.s = z ? z : 1};
+}
+
+uint64_t rng_next(Rng *r)
+{
+  r->s ^= r->s >> 12;
+  r->s ^= r->s << 25;
+  r->s ^= r->s >> 27;
+  return r->s * 0x2545F4914F6CDD1Dull;
+}
 
-int main(int argc, char **argv)
+// 0以上m未満の整数
+int rng_int(Rng *r, int m)
+{
+  return (int)((rng_next(r) >> 32) * (uint64_t)m >> 32);
+}
+
+// 標準正規分布 (Box-Muller)
+double rng_normal(Rng *r)
+{
+  const double u1 = ((rng_next(r) >> 11) + 1) * (1.0 / 9007199254740993.0); // (0, 1]
+  const double u2 = (rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+  return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+static int clamp(int v, int lo, int hi)
+{
+  return (v < lo) ? lo : (v > hi) ? hi : v;
+}
+
+// chunk番目のかたまり (都市 chunk*CHUNK 番から最大CHUNK個) の座標をbufに入れる
+void generate_chunk(const Generator *gen, long long chunk, int *buf)
+{
+  const GenConfig *conf = gen->conf;
+  const long long first = chunk * CHUNK;
+  const int m = (gen->nc - first < CHUNK) ? (int)(gen->nc - first) : CHUNK;
+  Rng r = rng_init(conf->seed, (uint64_t)chunk);
+  for (int i = 0 ; i < m ; i++){
+    int x, y;
+    switch (conf->dist){
+    case DIST_CLUSTER: {
+      const Point c = gen->centers[rng_int(&r, conf->clusters)];
+      x = clamp(c.x + (int)lround(gen->sigma * rng_normal(&r)), 0, conf->max_x - 1);
+      y = clamp(c.y + (int)lround(gen->sigma * rng_normal(&r)), 0, conf->max_y - 1);
+      break;
+    }
+    case DIST_GRID: {
+      const long long k = first + i;
+      x = (int)((k % gen->grid_side) * conf->max_x / gen->grid_side);
+      y = (int)((k / gen->grid_side) * conf->max_y / gen->grid_side);
+      break;
+    }
+    default:
+      x = rng_int(&r, conf->max_x);
+      y = rng_int(&r, conf->max_y);
+      break;
+    }
+    buf[2*i] = x;
+    buf[2*i+1] = y;
+  }
+}
+
+static void *generate_worker(void *arg)
+{
+  GenTask *t = (GenTask*)arg;
+  if (t->chunk >= 0) generate_chunk(t->gen, t->chunk, t->buf);
+  return NULL;
+}
+
+// ヘッダを書く (バージョン付きの形式ではCRCは最後に書き直す)
+int begin_output(Output *out, int nc, const char *meta)
+{
+  out->crc = 0;
+  if (!out->versioned) return fwrite(&nc,sizeof(int),1,out->fp) == 1;
+  out->header = bin_header(BIN_CITY_I32, (uint64_t)nc, (uint32_t)strlen(meta));
+  return write_bin_header(out->fp, &out->header, meta);
+}
+
+// m都市分の座標 (x, y, x, y, ...) を書く
+int write_cities(Output *out, const int *data, size_t m)
+{
+  if (out->versioned) out->crc = crc32_update(out->crc, data, sizeof(int) * 2 * m);
+  return fwrite(data, sizeof(int), 2 * m, out->fp) == 2 * m;
+}
+
+int finish_output(Output *out)
+{
+  int ok = 1;
+  if (out->versioned){
+    out->header.crc32 = out->crc;
+    out->header.flags |= BIN_HAS_CRC;
+    ok = fseek(out->fp, 0, SEEK_SET) == 0 && fwrite(&out->header, sizeof(BinHeader), 1, out->fp) == 1;
+  }
+  return (fclose(out->fp) == 0) && ok;
+}
+
+// 従来の生成方法 (70x40 の地図の中に rand() で置く)
+int write_legacy(int nc, int seed, Output *out)
 {
   const int width = 70;
   const int height = 40;
   const int max_cities = 100;
-
-  if(argc != 4){
-    fprintf(stderr, "usage: %s <number of cities> <random seed> <outputfilename>\n",argv[0]);
-    return EXIT_FAILURE;
-  }
-  int nc = load_int(argv[1]);
   assert( nc > 1 && nc <= max_cities);
-  int seed = load_int(argv[2]);
   srand(seed);
 
   int *data = (int*)malloc(sizeof(int)*2*nc);
@@ -45,15 +224,175 @@ int main(int argc, char **argv)
     data[2*i] = rand() % (width - 10) + 5;;
     data[2*i+1] = rand() % (height - 10) + 5;;
   }
+  char meta[64];
+  snprintf(meta, sizeof(meta), "gencity legacy seed=%d", seed);
+  const int ok = begin_output(out, nc, meta) && write_cities(out, data, nc);
+  free(data);
+  return ok;
+}
+
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// オプション
+//  -d uniform|cluster|grid : 町の置き方
+//  -x X, -y Y : 座標の範囲 (0以上X未満, 0以上Y未満。既定は 100000)
+//  -c K : clusterの中心の数 (既定は 都市数/1000 と 1 の大きい方)
+//  -t T : Tスレッドでかたまりを並列に作る (書き出す内容はスレッド数によらない)
+//  -f legacy|v1 : ファイルの形式 (既定は従来の形式)
+int main(int argc, char **argv)
+{
+  const char *usage = "usage: %s [-d uniform|cluster|grid] [-x max x] [-y max y] [-c clusters] [-t threads] [-f legacy|v1] <number of cities> <random seed> <outputfilename>\n";
+  GenConfig conf = {.dist = DIST_LEGACY, .max_x = 0, .max_y = 0, .clusters = 0, .threads = 1};
+  int scaled = 0; // 新しい生成方法を使うか
+  int versioned = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:x:y:c:t:f:")) != -1){
+    if (opt != 'f') scaled = 1;
+    switch (opt){
+    case 'f':
+      if (strcmp(optarg, "legacy") == 0) versioned = 0;
+      else if (strcmp(optarg, "v1") == 0) versioned = 1;
+      else {
+        fprintf(stderr, "%s: unknown file format.\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'd':
+      if (strcmp(optarg, "uniform") == 0) conf.dist = DIST_UNIFORM;
+      else if (strcmp(optarg, "cluster") == 0) conf.dist = DIST_CLUSTER;
+      else if (strcmp(optarg, "grid") == 0) conf.dist = DIST_GRID;
+      else {
+        fprintf(stderr, "%s: unknown distribution.\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'x':
+      conf.max_x = load_int(optarg);
+      assert( conf.max_x > 0 );
+      break;
+    case 'y':
+      conf.max_y = load_int(optarg);
+      assert( conf.max_y > 0 );
+      break;
+    case 'c':
+      conf.clusters = load_int(optarg);
+      assert( conf.clusters > 0 );
+      break;
+    case 't':
+      conf.threads = load_int(optarg);
+      assert( conf.threads > 0 );
+      break;
+    default:
+      fprintf(stderr, usage, argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if(argc - optind != 3){
+    fprintf(stderr, usage, argv[0]);
+    return EXIT_FAILURE;
+  }
+  int nc = load_int(argv[optind]);
+  int seed = load_int(argv[optind + 1]);
+  const char *filename = argv[optind + 2];
 
   FILE *fp;
-  if ((fp = fopen(argv[3],"wb")) == NULL){
-    fprintf(stderr, "%s: cannot open file.\n",argv[3]);
+  if ((fp = fopen(filename,"wb")) == NULL){
+    fprintf(stderr, "%s: cannot open file.\n",filename);
     return EXIT_FAILURE;
   }
-  fwrite(&nc,sizeof(int),1,fp);
-  fwrite(data,sizeof(int),2*nc,fp);
-  fclose(fp);
-  
+  Output out = {.fp = fp, .versioned = versioned};
+  if (!scaled){
+    if (!write_legacy(nc, seed, &out) || !finish_output(&out)){
+      fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+
+  assert( nc > 1 ); // 個数はintのヘッダに入る範囲ならいくつでもよい
+  if (conf.dist == DIST_LEGACY) conf.dist = DIST_UNIFORM;
+  if (conf.max_x == 0) conf.max_x = 100000;
+  if (conf.max_y == 0) conf.max_y = 100000;
+  if (conf.clusters == 0) conf.clusters = (nc / 1000 > 1) ? nc / 1000 : 1;
+  conf.seed = (uint64_t)(unsigned int)seed;
+
+  Generator gen = {.conf = &conf, .nc = nc, .grid_side = 0, .centers = NULL, .sigma = 0};
+  Point *centers = NULL;
+  if (conf.dist == DIST_GRID){
+    gen.grid_side = (int)ceil(sqrt((double)nc));
+  }
+  if (conf.dist == DIST_CLUSTER){
+    // 中心はかたまりとは別のストリームから作る
+    centers = (Point*)malloc(sizeof(Point) * conf.clusters);
+    Rng r = rng_init(conf.seed, UINT64_MAX);
+    for (int k = 0 ; k < conf.clusters ; k++){
+      centers[k] = (Point){.x = rng_int(&r, conf.max_x), .y = rng_int(&r, conf.max_y)};
+    }
+    gen.centers = centers;
+    // 中心1つあたりの面積の半径くらいに広げる
+    gen.sigma = 0.25 * sqrt((double)conf.max_x * conf.max_y / conf.clusters);
+  }
+
+  const double start = now_sec();
+  static const char *dist_name[] = {"legacy", "uniform", "cluster", "grid"};
+  char meta[128];
+  snprintf(meta, sizeof(meta), "gencity %s x=%d y=%d clusters=%d seed=%d",
+           dist_name[conf.dist], conf.max_x, conf.max_y, conf.clusters, seed);
+  if (!begin_output(&out, nc, meta)){
+    fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  const long long chunks = (nc + (long long)CHUNK - 1) / CHUNK;
+  const int T = conf.threads;
+  int *bufs = (int*)malloc(sizeof(int) * 2 * CHUNK * T);
+  GenTask *tasks = (GenTask*)malloc(sizeof(GenTask) * T);
+  pthread_t *tid = (pthread_t*)malloc(sizeof(pthread_t) * T);
+  if (bufs == NULL || tasks == NULL || tid == NULL){
+    fprintf(stderr, "cannot allocate buffers.\n");
+    return EXIT_FAILURE;
+  }
+  // T個のかたまりを並列に作り、番号順に書き出すのを繰り返す
+  for (long long base = 0 ; base < chunks ; base += T){
+    for (int t = 0 ; t < T ; t++){
+      tasks[t] = (GenTask){.gen = &gen, .buf = bufs + (size_t)2 * CHUNK * t,
+                           .chunk = (base + t < chunks) ? base + t : -1};
+    }
+    if (T == 1){
+      generate_worker(&tasks[0]);
+    } else {
+      for (int t = 0 ; t < T ; t++){
+        if (pthread_create(&tid[t], NULL, generate_worker, &tasks[t]) != 0){
+          fprintf(stderr, "cannot create a thread.\n");
+          return EXIT_FAILURE;
+        }
+      }
+      for (int t = 0 ; t < T ; t++) pthread_join(tid[t], NULL);
+    }
+    for (int t = 0 ; t < T && base + t < chunks ; t++){
+      const long long first = (base + t) * CHUNK;
+      const size_t m = (nc - first < CHUNK) ? (size_t)(nc - first) : CHUNK;
+      if (!write_cities(&out, tasks[t].buf, m)){
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  if (!finish_output(&out)){
+    fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  const double sec = now_sec() - start;
+  const double mb = 2.0 * sizeof(int) * nc / (1 << 20);
+  fprintf(stderr, "%d cities, %.1f MB in %.3f s (%.1f MB/s)\n", nc, mb, sec, (sec > 0) ? mb / sec : 0.0);
+
+  free(tid);
+  free(tasks);
+  free(bufs);
+  free(centers);
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,385 @@
+// 町・品物・結果のファイルをどの形式で読み書きするかを決めるための、ファイル入出力の速さの測定
+// (writebinaryfile.c / readbinary.c と同じ 0.5423 * rand() の double 列を使う)
+//
+// コンパイル: gcc -O2 iobench.c -o iobench
+// 使い方: iobench [-n counts] [-b buffer sizes] [-r repeats] [-d dir] [-c] [-T]
+//  -n 1000000,10000000 : 測るdoubleの個数 (カンマ区切り)
+//  -b 4096,65536,1048576 : fwrite/fread と O_DIRECT で1回に読み書きするバイト数 (カンマ区切り)
+//  -r 3 : 同じ測定を繰り返す回数
+//  -d . : 一時ファイルを置くディレクトリ
+//  -c : ページキャッシュを捨ててから読む (cold) 測定もする
+//  -T : テキスト (fprintf/fscanf) も測る (遅いので既定では測らない)
+//
+// 結果は CSV で標準出力に書く:
+//  method,op,values,bytes,buffer,cache,rep,seconds,mb_per_s
+//   method: text, stdio, mmap, direct。op: write, read
+//   cache: 書き込みは fsync まで含めた時間なので sync、読み込みは warm か cold
+//  読み込んだ double は元のデータと比べ (textは "%f" の丸めがあるので比べない)、違えば終了する
+#define _GNU_SOURCE // O_DIRECT
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAX_LIST 16
+#define DIRECT_ALIGN 4096 // O_DIRECT で読み書きする位置・大きさ・バッファの境界
+
+typedef enum
+{
+  CACHE_SYNC,  // 書き込み (fsyncまで)
+  CACHE_WARM,  // 書いた直後のページキャッシュに残っている状態で読む
+  CACHE_COLD,  // posix_fadvise(DONTNEED) でキャッシュを捨ててから読む
+} CacheMode;
+
+typedef struct
+{
+  const char *path;
+  const double *src; // 書くデータ
+  double *dst;       // 読んだデータの置き場所
+  size_t count;
+} Bench;
+
+int load_int(const char *argvalue);
+int parse_list(const char *arg, long *list);
+
+int load_int(const char *argvalue)
+{
+  long nl;
+  char *e;
+  errno = 0; // errno.h で定義されているグローバル変数を一旦初期化
+  nl = strtol(argvalue,&e,10);
+  if (errno == ERANGE){
+    fprintf(stderr,"%s: %s\n",argvalue,strerror(errno));
+    exit(1);
+  }
+  if (*e != '\0'){
+    fprintf(stderr,"%s: an irregular character '%c' is detected.\n",argvalue,*e);
+    exit(1);
+  }
+  return (int)nl;
+}
+
+// "a,b,c" を読んで個数を返す
+int parse_list(const char *arg, long *list)
+{
+  int n = 0;
+  const char *p = arg;
+  while (*p != '\0'){
+    char *e;
+    errno = 0;
+    const long v = strtol(p, &e, 10);
+    if (e == p || errno == ERANGE || v <= 0 || (*e != ',' && *e != '\0') || n == MAX_LIST){
+      fprintf(stderr, "%s: expected a comma separated list of positive integers.\n", arg);
+      exit(1);
+    }
+    list[n++] = v;
+    p = (*e == ',') ? e + 1 : e;
+  }
+  return n;
+}
+
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void die(const char *what, const char *path)
+{
+  fprintf(stderr, "%s: %s: %s\n", path, what, strerror(errno));
+  exit(1);
+}
+
+// ファイルの中身をディスクに書き、ページキャッシュから捨てる
+static void drop_cache(const char *path)
+{
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) die("open", path);
+  fsync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+static void sync_file(FILE *fp, const char *path)
+{
+  if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) die("fsync", path);
+}
+
+// 書く関数は書けたら1を返す (失敗したら終了する)。読む関数は読めたら1を返す
+// ---- テキスト (fprintf / fscanf) ----
+static int text_write(const Bench *b, size_t buffer)
+{
+  (void)buffer;
+  FILE *fp = fopen(b->path, "w");
+  if (fp == NULL) die("fopen", b->path);
+  fprintf(fp, "%zu\n", b->count);
+  for (size_t i = 0 ; i < b->count ; i++) fprintf(fp, "%f\n", b->src[i]);
+  sync_file(fp, b->path);
+  fclose(fp);
+  return 1;
+}
+
+static int text_read(const Bench *b, size_t buffer)
+{
+  (void)buffer;
+  FILE *fp = fopen(b->path, "r");
+  if (fp == NULL) die("fopen", b->path);
+  size_t count;
+  int ok = (fscanf(fp, "%zu", &count) == 1 && count == b->count);
+  for (size_t i = 0 ; ok && i < count ; i++) ok = (fscanf(fp, "%lf", &b->dst[i]) == 1);
+  fclose(fp);
+  return ok;
+}
+
+// ---- fwrite / fread (buffer バイトずつ, setvbuf も同じ大きさ) ----
+static int stdio_write(const Bench *b, size_t buffer)
+{
+  FILE *fp = fopen(b->path, "wb");
+  if (fp == NULL) die("fopen", b->path);
+  setvbuf(fp, NULL, _IOFBF, buffer);
+  const char *p = (const char*)b->src;
+  const size_t bytes = sizeof(double) * b->count;
+  for (size_t off = 0 ; off < bytes ; off += buffer){
+    const size_t m = (bytes - off < buffer) ? bytes - off : buffer;
+    if (fwrite(p + off, 1, m, fp) != m) die("fwrite", b->path);
+  }
+  sync_file(fp, b->path);
+  fclose(fp);
+  return 1;
+}
+
+static int stdio_read(const Bench *b, size_t buffer)
+{
+  FILE *fp = fopen(b->path, "rb");
+  if (fp == NULL) die("fopen", b->path);
+  setvbuf(fp, NULL, _IOFBF, buffer);
+  char *p = (char*)b->dst;
+  const size_t bytes = sizeof(double) * b->count;
+  int ok = 1;
+  for (size_t off = 0 ; ok && off < bytes ; off += buffer){
+    const size_t m = (bytes - off < buffer) ? bytes - off : buffer;
+    ok = (fread(p + off, 1, m, fp) == m);
+  }
+  fclose(fp);
+  return ok;
+}
+
+// ---- mmap (書くときはファイルを伸ばしてからmemcpy, 読むときはmemcpy) ----
+static int mmap_write(const Bench *b, size_t buffer)
+{
+  (void)buffer;
+  const size_t bytes = sizeof(double) * b->count;
+  const int fd = open(b->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) die("open", b->path);
+  if (ftruncate(fd, (off_t)bytes) != 0) die("ftruncate", b->path);
+  void *addr = mmap(NULL, bytes, PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) die("mmap", b->path);
+  memcpy(addr, b->src, bytes);
+  if (msync(addr, bytes, MS_SYNC) != 0) die("msync", b->path);
+  munmap(addr, bytes);
+  close(fd);
+  return 1;
+}
+
+static int mmap_read(const Bench *b, size_t buffer)
+{
+  (void)buffer;
+  const size_t bytes = sizeof(double) * b->count;
+  const int fd = open(b->path, O_RDONLY);
+  if (fd < 0) die("open", b->path);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size != bytes){
+    close(fd);
+    return 0;
+  }
+  void *addr = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) die("mmap", b->path);
+  madvise(addr, bytes, MADV_SEQUENTIAL);
+  memcpy(b->dst, addr, bytes);
+  munmap(addr, bytes);
+  close(fd);
+  return 1;
+}
+
+// ---- O_DIRECT (ページキャッシュを通さない。buffer バイトずつ, 境界にそろえたバッファで) ----
+// 使えないファイルシステム (tmpfs など) では 0 を返す
+static int direct_write(const Bench *b, size_t buffer)
+{
+  const size_t bytes = sizeof(double) * b->count;
+  const int fd = open(b->path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+  if (fd < 0) return 0;
+  void *buf;
+  if (posix_memalign(&buf, DIRECT_ALIGN, buffer) != 0) die("posix_memalign", b->path);
+  int ok = 1;
+  for (size_t off = 0 ; ok && off < bytes ; off += buffer){
+    const size_t m = (bytes - off < buffer) ? bytes - off : buffer;
+    const size_t padded = (m + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN; // 最後だけ詰め物をする
+    memcpy(buf, (const char*)b->src + off, m);
+    memset((char*)buf + m, 0, padded - m);
+    ok = (write(fd, buf, padded) == (ssize_t)padded);
+  }
+  ok = ok && ftruncate(fd, (off_t)bytes) == 0 && fsync(fd) == 0;
+  free(buf);
+  close(fd);
+  return ok;
+}
+
+static int direct_read(const Bench *b, size_t buffer)
+{
+  const size_t bytes = sizeof(double) * b->count;
+  const int fd = open(b->path, O_RDONLY | O_DIRECT);
+  if (fd < 0) return 0;
+  void *buf;
+  if (posix_memalign(&buf, DIRECT_ALIGN, buffer) != 0) die("posix_memalign", b->path);
+  int ok = 1;
+  for (size_t off = 0 ; ok && off < bytes ; off += buffer){
+    const size_t m = (bytes - off < buffer) ? bytes - off : buffer;
+    const size_t padded = (m + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    const ssize_t r = read(fd, buf, padded);
+    ok = (r >= (ssize_t)m);
+    if (ok) memcpy((char*)b->dst + off, buf, m);
+  }
+  free(buf);
+  close(fd);
+  return ok;
+}
+
+typedef struct
+{
+  const char *name;
+  int (*write)(const Bench *b, size_t buffer);
+  int (*read)(const Bench *b, size_t buffer);
+  int uses_buffer; // バッファの大きさごとに測るか
+  int exact;       // 読んだ値が元と一致するはず
+} Method;
+
+static void print_row(const char *method, const char *op, const Bench *b, size_t bytes, size_t buffer,
+                      CacheMode cache, int rep, double sec)
+{
+  static const char *cache_name[] = {"sync", "warm", "cold"};
+  printf("%s,%s,%zu,%zu,%zu,%s,%d,%.6f,%.1f\n", method, op, b->count, bytes, buffer,
+         cache_name[cache], rep, sec, (sec > 0) ? bytes / 1048576.0 / sec : 0.0);
+  fflush(stdout);
+}
+
+// 1つの方法・バッファの大きさについて、書く→(warm)読む→(cold)読む を repeats 回
+static void run_method(const Method *m, const Bench *b, size_t buffer, int repeats, int cold)
+{
+  for (int rep = 0 ; rep < repeats ; rep++){
+    double t = now_sec();
+    if (!m->write(b, buffer)){
+      fprintf(stderr, "%s: %s is not supported here (%s). skipped.\n", b->path, m->name, strerror(errno));
+      return;
+    }
+    t = now_sec() - t;
+    struct stat st;
+    if (stat(b->path, &st) != 0) die("stat", b->path);
+    const size_t bytes = (size_t)st.st_size;
+    print_row(m->name, "write", b, bytes, buffer, CACHE_SYNC, rep, t);
+
+    for (int c = CACHE_WARM ; c <= (cold ? CACHE_COLD : CACHE_WARM) ; c++){
+      if (c == CACHE_COLD) drop_cache(b->path);
+      memset(b->dst, 0, sizeof(double) * b->count);
+      t = now_sec();
+      const int ok = m->read(b, buffer);
+      t = now_sec() - t;
+      if (!ok || (m->exact && memcmp(b->src, b->dst, sizeof(double) * b->count) != 0)){
+        fprintf(stderr, "%s: %s read back different data.\n", b->path, m->name);
+        exit(1);
+      }
+      print_row(m->name, "read", b, bytes, buffer, (CacheMode)c, rep, t);
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *usage = "usage: %s [-n counts] [-b buffer sizes] [-r repeats] [-d dir] [-c] [-T]\n";
+  long counts[MAX_LIST] = {1000000, 10000000};
+  int ncounts = 2;
+  long buffers[MAX_LIST] = {4096, 65536, 1048576};
+  int nbuffers = 3;
+  int repeats = 3;
+  const char *dir = ".";
+  int cold = 0, text = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:b:r:d:cT")) != -1){
+    switch (opt){
+    case 'n':
+      ncounts = parse_list(optarg, counts);
+      break;
+    case 'b':
+      nbuffers = parse_list(optarg, buffers);
+      break;
+    case 'r':
+      repeats = load_int(optarg);
+      assert( repeats > 0 );
+      break;
+    case 'd':
+      dir = optarg;
+      break;
+    case 'c':
+      cold = 1;
+      break;
+    case 'T':
+      text = 1;
+      break;
+    default:
+      fprintf(stderr, usage, argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (argc != optind){
+    fprintf(stderr, usage, argv[0]);
+    return EXIT_FAILURE;
+  }
+  for (int i = 0 ; i < nbuffers ; i++){
+    if (buffers[i] % DIRECT_ALIGN != 0){
+      fprintf(stderr, "buffer sizes must be multiples of %d (for O_DIRECT).\n", DIRECT_ALIGN);
+      return EXIT_FAILURE;
+    }
+  }
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/iobench.%d.tmp", dir, (int)getpid());
+  const Method methods[] = {
+    {"text",   text_write,   text_read,   0, 0},
+    {"stdio",  stdio_write,  stdio_read,  1, 1},
+    {"mmap",   mmap_write,   mmap_read,   0, 1},
+    {"direct", direct_write, direct_read, 1, 1},
+  };
+
+  printf("method,op,values,bytes,buffer,cache,rep,seconds,mb_per_s\n");
+  for (int k = 0 ; k < ncounts ; k++){
+    const size_t count = (size_t)counts[k];
+    double *src = (double*)malloc(sizeof(double) * count);
+    double *dst = (double*)malloc(sizeof(double) * count);
+    if (src == NULL || dst == NULL){
+      fprintf(stderr, "cannot allocate %zu values.\n", count);
+      return EXIT_FAILURE;
+    }
+    srand(100);
+    for (size_t i = 0 ; i < count ; i++) src[i] = 0.5423 * rand();
+    const Bench b = {.path = path, .src = src, .dst = dst, .count = count};
+    for (size_t m = 0 ; m < sizeof(methods) / sizeof(methods[0]) ; m++){
+      if (methods[m].write == text_write && !text) continue; // テキストは -T のときだけ
+      if (methods[m].uses_buffer){
+        for (int i = 0 ; i < nbuffers ; i++) run_method(&methods[m], &b, (size_t)buffers[i], repeats, cold);
+      } else {
+        run_method(&methods[m], &b, 0, repeats, cold);
+      }
+    }
+    free(src);
+    free(dst);
+  }
+  unlink(path);
+  return EXIT_SUCCESS;
+}
@@ -3,25 +3,41 @@
 #include <assert.h>
 #include <string.h> // strtol, strtod, strerror
 #include <errno.h> // strtol, strtod でerror を補足したい
+#include <unistd.h> // getopt
+#include <time.h> // clock_gettime
+#include <stdint.h> // uint64_t
+#include <limits.h> // INT_MAX
+#include <math.h> // ceil, llround
+#include <pthread.h>
+#include <stdatomic.h>
+#include "mapfile.h"
+
+// コンパイル: gcc -O2 -pthread knapsack.c -lm
 
 // 以下は構造体の定義と関数のプロトタイプ宣言
 
-// 構造体 Item
-// 価値valueと重さweightが格納されている
-//
-typedef struct item
-{
-  double value;
-  double weight;
-}Item;
+// 品物の価値・重さの型 (-DITEM_FLOAT でfloatにするとメモリが半分になる。合計はどちらでもdoubleで計算する)
+#ifdef ITEM_FLOAT
+typedef float item_t;
+#define ITEM_EPS 1e-4 // scale倍した重さを整数に切り上げるときに無視する丸め誤差
+#else
+typedef double item_t;
+#define ITEM_EPS 1e-9
+#endif
 
 // 構造体 Itemset
-// number分のItemを保持するための構造体
-// Itemポインタをmallocする必要あり
+// number個の品物の価値valueと重さweightを別々の配列に格納する (ファイルの並びと同じ)
+// 2つの配列は64バイト境界にそろえた1つの領域blockから切り出すので、freeはblockだけでよい
+// バージョン付きの形式のファイルから読んだときは、mmapした領域(file)をそのまま指す (blockはNULL)
+// mmapした領域は読み込み専用なので、value, weight はconstにしておく (書き換えるとコンパイルで止まる)。
+// 自分で確保したblockに書くときは writable_items を通す
 typedef struct itemset
 {
   int number;
-  Item *item;
+  const item_t *value;
+  const item_t *weight;
+  void *block;
+  MappedFile file;
 } Itemset;
 
 typedef struct answer
@@ -30,8 +46,60 @@ typedef struct answer
   char *flags;
 }Answer;
 
+// 探索の葉を書き出す先
+// 全ての葉をprintfすると探索よりも出力の方が遅くなるので、every個に1個だけ書く
+typedef struct
+{
+  FILE *fp;        // NULLなら何も書かない (-q)
+  long long every; // 何個の葉ごとに1個書くか (-e)
+} TraceSink;
+
+// 解き方 (-m オプション)
+typedef enum
+{
+  SOLVE_SEARCH, // 全ての組み合わせを調べる (2^n)
+  SOLVE_DP,     // 容量を添字にした動的計画法 (重さを整数に直す)
+  SOLVE_DPV,    // 価値を添字にした動的計画法 (価値を整数に直す, 容量が大きいとき向け)
+  SOLVE_BB,     // 分枝限定法 (分数ナップサックの解を上界に使う)
+  SOLVE_MITM,   // 半分全列挙 (2^(n/2), 60個程度まで)
+} SolveMode;
+
+// 品物を入れたかどうかのビット列 (品物i は words[i/64] の i%64 ビット目)
+typedef uint64_t Bits;
+
+// 探索の状態
+// 暫定解のビット列はsolveで1度だけ確保し、よりよい葉が見つかったときだけ上書きする
+typedef struct
+{
+  double best_value;
+  Bits *best;       // 暫定解
+  TraceSink trace;
+  long long leaves; // 調べた葉の数
+  // 並列探索のときだけ使う (逐次のときはNULL)
+  _Atomic double *shared; // 全スレッドの暫定解の最大価値
+  const double *rest;     // rest[i] = 品物i以降の価値の合計 (これを足しても届かない枝は調べない)
+} SearchState;
+
 // 関数のプロトサイプ宣言
 
+// 解くときの作業領域を切り出すアリーナ (-a オプション)
+// 最初に1度だけ大きな領域を確保しておき、ソルバーの中の確保は先頭から順に切り出すだけにする。
+// 解き終わったら used を0に戻せば全部まとめて解放したことになる
+typedef struct
+{
+  char *base;
+  size_t size;
+  size_t used;
+} Arena;
+
+// void *scratch_alloc(size_t bytes), void scratch_free(void *p)
+//
+// ソルバーの中で使う領域の確保/解放 (0で初期化済みの領域を返す)
+//  アリーナを使うときはそこから切り出し、使わないときはcallocする。
+//  callocした回数は数えておき、ベンチマーク(-b)で1回あたりの確保回数として表示する
+void *scratch_alloc(size_t bytes);
+void scratch_free(void *p);
+
 // Itemset *init_itemset(int, int);
 //
 // itemsetを初期化し、そのポインタを返す関数
@@ -42,15 +110,23 @@ typedef struct answer
 //  確保されたItemset へのポインタ
 Itemset *init_itemset(int number, int seed);
 
+// Itemset *new_itemset(int number)
+//
+// number個の品物を入れる領域を確保する (価値・重さは未設定)
+Itemset *new_itemset(int number);
+
 void free_itemset(Itemset *list);
 
 // Itemset *load_itemset(char *filename)
 //
-// ファイルからItemset を設定し、確保された領域へのポインタを返す関数 [未実装, 課題1]
+// ファイルからItemset を設定し、確保された領域へのポインタを返す関数
+//  従来の形式は 個数(int), 価値(double x 個数), 重さ(double x 個数) の順。
+//  mmapして大きさを確かめ、価値と重さをそれぞれ1回のmemcpyで64バイト境界の配列に写す。
+//  バージョン付きの形式は価値と重さが64バイト境界から始まるので、item_tがdoubleならコピーせずにそのまま使う
 // 引数:
 //  Itemsetの必要パラメータが記述されたバイナリファイルのファイル名 filename (char*)
 // 返り値:
-//  Itemset へのポインタ
+//  Itemset へのポインタ (開けない・大きさが合わないときは終了する)
 Itemset *load_itemset(char *filename);
 
 // void print_itemset(const Itemset *list)
@@ -58,25 +134,27 @@ Itemset *load_itemset(char *filename);
 // Itemsetの内容を標準出力に表示する関数
 void print_itemset(const Itemset *list);
 
-// void save_itemset(char *filename)
+// int save_itemset(const Itemset *list, const char *filename)
 //
-// Itemsetのパラメータを記録したバイナリファイルを出力する関数 [未実装, テスト用]
+// Itemsetのパラメータを記録したバイナリファイルを出力する関数 (-o オプション)
+//  バージョン付きの形式 (mapfile.h の BIN_ITEM_F64, CRC付き) で書く
 // 引数:
-// Itemsetの必要パラメータを吐き出すファイルの名前 filename (char*)
+// 書き出すItemset: list, Itemsetの必要パラメータを吐き出すファイルの名前 filename (char*)
 // 返り値:
-//  なし
-void save_itemset(char *filename);
+//  書けたら1, 書けなかったら0
+int save_itemset(const Itemset *list, const char *filename);
 
 // double solve()
 //
-// ソルバー関数: 指定された設定でナップサック問題をとく [現状、未完成]
+// ソルバー関数: 指定された設定でナップサック問題をとく
 // 引数:
 //   品物のリスト: Itemset *list
 //   ナップサックの容量: capacity (double)
+//   葉の書き出し先: trace (TraceSink)
 // 返り値:
-//   最適時の価値の総和を返す
+//   最適時の価値の総和と、そのときに入れた品物のフラグ (flagsはscratch_allocで確保しているのでscratch_freeする)
 //
-Answer solve(const Itemset *list, double capacity);
+Answer solve(const Itemset *list, double capacity, TraceSink trace);
 
 // double search()
 //
@@ -86,11 +164,57 @@ Answer solve(const Itemset *list, double capacity);
 //  指定index : index (int)
 //  品物リスト: list (Itemset*)
 //  ナップサックの容量: capacity (double)
-//  実際にナップサックに入れた品物を記録するフラグ: flags (int*)
+//  実際にナップサックに入れた品物を記録するビット列: flags (Bits*)
 //  途中までの価値と重さ (ポインタではない点に注意): sum_v, sum_w
+//  暫定解などの探索の状態: st (SearchState*)
+// 返り値:
+//   なし (最適な組み合わせは st->best に入る)
+void search(int index, const Itemset *list, double capacity, Bits *flags, double sum_v, double sum_w, SearchState *st);
+
+// Answer solve_par(const Itemset *list, double capacity, int threads)
+//
+// searchを threads 個のスレッドで並列に行う (-m search -t N)
+//  上から数段の選び方(入れない→入れるの順)をタスクにして、空いたスレッドが順に取っていく。
+//  暫定解の価値はスレッド間で共有し、残り全部を入れても届かない枝は調べない。
+//  同じ価値の解は逐次のsearchが先に見つける方(タスクの番号が小さい方)を選ぶので、結果は逐次と同じになる。
+//  調べる葉がスレッドの進み方で変わるので、葉の書き出しはしない
+// 返り値は solve と同じ
+Answer solve_par(const Itemset *list, double capacity, int threads);
+
+// Answer solve_dp(const Itemset *list, double capacity, double scale)
+//
+// 容量を添字にした動的計画法: dp[c] = 重さの合計がc以下で得られる最大の価値
+//  重さをscale倍して切り上げた整数で扱う (重さが1/scaleの倍数なら厳密解)
+//  どの品物を入れたかは n x (容量+1) ビットのビット列に記録して、最後にたどり直す
+// 引数:
+//   品物のリスト: list, ナップサックの容量: capacity, 重さを整数にする倍率: scale
 // 返り値:
-//   最適時の価値の総和を返す
-Answer search(int index, const Itemset *list, double capacity, int *flags, double sum_v, double sum_w);
+//   最適時の価値の総和とフラグ (flagsはfreeする)
+Answer solve_dp(const Itemset *list, double capacity, double scale);
+
+// Answer solve_dpv(const Itemset *list, double capacity, double scale)
+//
+// 価値を添字にした動的計画法: minw[v] = 価値の合計がちょうどvになる最小の重さ
+//  価値をscale倍して四捨五入した整数で扱う。重さはdoubleのまま比べるので容量がどれだけ大きくてもよい
+// 引数・返り値は solve_dp と同じ
+Answer solve_dpv(const Itemset *list, double capacity, double scale);
+
+// Answer solve_bb(const Itemset *list, double capacity)
+//
+// 分枝限定法: 品物を 価値/重さ の大きい順に並べ、入れる→入れない の順に探索する
+//  残りの品物を分割してよいとした(分数ナップサックの)最大価値を上界にして、
+//  暫定解を超えられない枝は調べない
+// 引数・返り値は solve と同じ (traceは使わない)
+Answer solve_bb(const Itemset *list, double capacity);
+
+// Answer solve_mitm(const Itemset *list, double capacity)
+//
+// 半分全列挙 (meet in the middle): 品物を前半と後半に分け、それぞれの選び方を
+//  重さの小さい順に並べて「より重いのに価値が大きくならない」ものを捨てた列(パレートフロンティア)にする。
+//  前半を軽い順、後半を重い順にたどって、容量に収まる組の最大価値を求める。
+//  重さ・価値はdoubleのまま扱う厳密解。時間・メモリは O(2^(n/2)) で、選び方を64ビットで表すので n <= 64
+// 引数・返り値は solve_bb と同じ
+Answer solve_mitm(const Itemset *list, double capacity);
 
 // エラー判定付きの読み込み関数
 int load_int(const char *argvalue);
@@ -130,55 +254,167 @@ double load_double(const char *argvalue)
 }
 
 
+// 経過時間 (秒)
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static Arena *scratch_arena = NULL; // NULLならcallocを使う
+static long long alloc_count = 0;   // scratch_alloc がcallocを呼んだ回数
+
+static void use_arena(Arena *a)
+{
+  scratch_arena = a;
+}
+
+void *scratch_alloc(size_t bytes)
+{
+  if (scratch_arena == NULL){
+    alloc_count++;
+    void *p = calloc(1, bytes);
+    if (p == NULL && bytes > 0){
+      fprintf(stderr, "cannot allocate %zu bytes\n", bytes);
+      exit(1);
+    }
+    return p;
+  }
+  // 64バイト(キャッシュライン)境界にそろえて切り出す
+  const size_t start = (scratch_arena->used + 63) & ~(size_t)63;
+  if (start + bytes > scratch_arena->size){
+    fprintf(stderr, "arena is too small (%zu bytes more needed). increase -a.\n",
+            start + bytes - scratch_arena->size);
+    exit(1);
+  }
+  scratch_arena->used = start + bytes;
+  memset(scratch_arena->base + start, 0, bytes);
+  return scratch_arena->base + start;
+}
+
+void scratch_free(void *p)
+{
+  if (scratch_arena == NULL) free(p); // アリーナの領域はまとめて捨てるので何もしない
+}
+
+// 指定された解き方で解く
+static Answer run_solver(SolveMode mode, const Itemset *items, double W, double scale, TraceSink trace, int threads)
+{
+  switch (mode){
+  case SOLVE_DP:
+    return solve_dp(items, W, scale);
+  case SOLVE_DPV:
+    return solve_dpv(items, W, scale);
+  case SOLVE_BB:
+    return solve_bb(items, W);
+  case SOLVE_MITM:
+    return solve_mitm(items, W);
+  default:
+    if (threads > 1) return solve_par(items, W, threads);
+    return solve(items, W, trace);
+  }
+}
+
 // main関数
 // プログラム使用例: ./knapsack 10 20
 //  10個の品物を設定し、キャパ20 でナップサック問題をとく
+// オプション:
+//  -m search|dp|dpv|bb : 解き方 (既定はsearch)
+//  -s scale : 動的計画法で重さ(dp)/価値(dpv)を整数にするときの倍率 (既定は10, 値が0.1刻みなので)
+//  -q : 探索の葉を書き出さない
+//  -e N : N個に1個の葉だけ書き出す
+//  -a MB : ソルバーの作業領域を MB メガバイトのアリーナから切り出す (mallocを呼ばない)
+//  -b N : N回解いて、1回あたりの時間と確保回数を表示する
+//  -t N : 全探索をNスレッドで並列に行う (葉は書き出さない)
+//  -o FILE : 品物をバージョン付きの形式でFILEに書き出す (ファイルから読んだ品物の形式の変換にも使える)
 int main (int argc, char**argv)
 {
   /* 引数処理: ユーザ入力が正しくない場合は使い方を標準エラーに表示して終了 */
+  const char *usage = "usage: %s [-m search|dp|dpv|bb|mitm] [-s scale] [-q] [-e every] [-a arena MB] [-b repeat] [-t threads (search only)] [-o output file] <the number of items (int)> <max capacity (double)> [item file]\n";
+  TraceSink trace = {.fp = stdout, .every = 1}; // 既定では今まで通り全ての葉を書く
+  SolveMode mode = SOLVE_SEARCH;
+  double scale = 10.0;
+  int repeat = 0;
+  int threads = 1;
+  const char *output = NULL;
+  Arena arena = {.base = NULL, .size = 0, .used = 0};
+  int opt;
+  while ((opt = getopt(argc, argv, "m:s:qe:a:b:t:o:")) != -1){
+    switch (opt){
+    case 'm':
+      if (strcmp(optarg, "search") == 0) mode = SOLVE_SEARCH;
+      else if (strcmp(optarg, "dp") == 0) mode = SOLVE_DP;
+      else if (strcmp(optarg, "dpv") == 0) mode = SOLVE_DPV;
+      else if (strcmp(optarg, "bb") == 0) mode = SOLVE_BB;
+      else if (strcmp(optarg, "mitm") == 0) mode = SOLVE_MITM;
+      else {
+        fprintf(stderr, "%s: unknown solve mode.\n", optarg);
+        exit(1);
+      }
+      break;
+    case 's':
+      scale = load_double(optarg);
+      assert( scale > 0.0 );
+      break;
+    case 'q':
+      trace.fp = NULL;
+      break;
+    case 'e':
+      trace.every = load_int(optarg);
+      assert( trace.every > 0 );
+      break;
+    case 'a':
+      arena.size = (size_t)load_int(optarg) << 20;
+      assert( arena.size > 0 );
+      break;
+    case 'b':
+      repeat = load_int(optarg);
+      assert( repeat > 0 );
+      break;
+    case 't':
+      threads = load_int(optarg);
+      assert( threads > 0 );
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    default:
+      fprintf(stderr, usage, argv[0]);
+      exit(1);
+    }
+  }
+  // 並列にできるのは全探索だけ。他の解き方で黙って1スレッドにならないように止める
+  if (threads > 1 && mode != SOLVE_SEARCH){
+    fprintf(stderr, "-t %d: only -m search runs on multiple threads.\n", threads);
+    exit(1);
+  }
+  // 残りの引数を argv[1] からにずらす (使い方の表示にはプログラム名を使うので先に取っておく)
+  const char *prog = argv[0];
+  argc -= optind - 1;
+  argv += optind - 1;
   if (argc != 3&&argc != 4){
-    fprintf(stderr, "usage: %s <the number of items (int)> <max capacity (double)>\n",argv[0]);
+    fprintf(stderr, usage, prog);
     exit(1);
   }
   
-  // 個数の上限はあらかじめ定めておく
+  // 個数の上限はあらかじめ定めておく (全探索のときだけ。他の解き方は何千個でも解ける)
   const int max_items = 100;
 
   const int n = load_int(argv[1]);
-  assert( n <= max_items ); // assert で止める
+  assert( n > 0 );
+  assert( mode != SOLVE_SEARCH || n <= max_items ); // assert で止める
+  assert( mode != SOLVE_MITM || n <= 64 );          // 選び方を64ビットで表すため
 
   const double W = load_double(argv[2]);
   assert( W >= 0.0);
   Itemset *items;
   if(argc == 4){
-    
-    FILE *fp;
-    if ( (fp = fopen(argv[3],"rb")) != NULL ) {
-        printf("open file %s\n",argv[3]);
-        int number;
-        fread(&number,sizeof(int),1,fp);
-        if(n!=number){
-          fprintf(stderr,"n is not right\n");
-          return EXIT_FAILURE;
-        }
-        items = (Itemset*)malloc(sizeof(Itemset));
-        Item *item = (Item*)malloc(sizeof(Item)*number);
-        double *d = (double*)malloc(sizeof(double)*number);
-        fread(d,sizeof(double),number,fp);
-        for (int i = 0 ; i < number ; i++){
-          item[i].value = d[i];
-        } 
-        fread(d,sizeof(double),number,fp);
-        for (int i = 0 ; i < number ; i++){
-          item[i].weight = d[i];
-        } 
-        *items = (Itemset){.number = number, .item = item};
-    }
-    else{
-      fprintf(stderr,"cannot open file %s\n",argv[3]);
+    items = load_itemset(argv[3]);
+    if(n!=items->number){
+      fprintf(stderr,"n is not right\n");
       return EXIT_FAILURE;
     }
-    fclose(fp);
   }
   else{
     // 乱数シードを1にして、初期化 (ここは変更可能)
@@ -190,9 +426,37 @@ int main (int argc, char**argv)
 
   
   print_itemset(items);
+  if (output != NULL && !save_itemset(items, output)){
+    fprintf(stderr, "%s: cannot write. (%s)\n", output, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (arena.size > 0){
+    arena.base = (char*)malloc(arena.size);
+    if (arena.base == NULL){
+      fprintf(stderr, "cannot allocate the arena (%zu bytes)\n", arena.size);
+      return EXIT_FAILURE;
+    }
+    use_arena(&arena);
+  }
+
+  // ベンチマーク: 同じ問題を repeat 回解いて、1回あたりの時間と確保回数を測る
+  if (repeat > 0){
+    const long long allocs0 = alloc_count;
+    const double start = now_sec();
+    for (int r = 0 ; r < repeat ; r++){
+      Answer a = run_solver(mode, items, W, scale, trace, threads);
+      scratch_free(a.flags);
+      if (arena.base != NULL) arena.used = 0;
+    }
+    const double sec = now_sec() - start;
+    fprintf(stderr, "benchmark: %d solves, %.3f ms/solve, %.1f allocations/solve (%s)\n",
+            repeat, sec * 1e3 / repeat, (double)(alloc_count - allocs0) / repeat,
+            (arena.base != NULL) ? "arena" : "malloc");
+  }
 
   // ソルバーで解く
-  Answer kotae = solve(items, W);
+  Answer kotae = run_solver(mode, items, W, scale, trace, threads);
 
 
   // 表示する
@@ -203,6 +467,8 @@ int main (int argc, char**argv)
   for (int i = 0 ; i < n ; i++){
       printf("%d", kotae.flags[i]);
     }
+  scratch_free(kotae.flags);
+  free(arena.base);
   free_itemset(items);
   printf("\n");
   return 0;
@@ -210,25 +476,124 @@ int main (int argc, char**argv)
 
 
 // 構造体をポインタで確保するお作法を確認してみよう
-Itemset *init_itemset(int number, int seed)
+Itemset *new_itemset(int number)
 {
   Itemset *list = (Itemset*)malloc(sizeof(Itemset));
+  // 重さの配列も64バイト境界から始まるように、1本あたりの長さを64バイトの倍数に切り上げる
+  const size_t per_line = 64 / sizeof(item_t);
+  const size_t stride = ((size_t)number + per_line - 1) / per_line * per_line;
+  item_t *block = (item_t*)aligned_alloc(64, sizeof(item_t) * 2 * (stride > 0 ? stride : per_line));
+  if (list == NULL || block == NULL){
+    fprintf(stderr, "cannot allocate %d items.\n", number);
+    exit(1);
+  }
+  *list = (Itemset){.number = number, .value = block, .weight = block + stride, .block = block,
+                    .file = {.addr = NULL, .size = 0}};
+  return list;
+}
 
-  Item *item = (Item*)malloc(sizeof(Item)*number);
+// new_itemset で確保したblockの中の配列 p (list->value か list->weight) を書き込み用として返す
+// mmapした品物 (blockがNULL) には使えない
+static item_t *writable_items(const Itemset *list, const item_t *p)
+{
+  assert( list->block != NULL );
+  return (item_t*)list->block + (p - (const item_t*)list->block);
+}
+
+Itemset *init_itemset(int number, int seed)
+{
+  Itemset *list = new_itemset(number);
+  item_t *value = writable_items(list, list->value);
+  item_t *weight = writable_items(list, list->weight);
 
   srand(seed);
   for (int i = 0 ; i < number ; i++){
-    item[i].value = 0.1 * (rand() % 200);
-    item[i].weight = 0.1 * (rand() % 200 + 1);//
+    value[i] = 0.1 * (rand() % 200);
+    weight[i] = 0.1 * (rand() % 200 + 1);//
   }
-  *list = (Itemset){.number = number, .item = item};
   return list;
 }
 
+// ファイルのdoubleの列をitem_tの配列に写す
+//  ファイルのdoubleは4バイト目から始まり8バイト境界にそろっていないので、直接は指さずにmemcpyする
+static void copy_items(item_t *dst, const char *src, int number)
+{
+#ifdef ITEM_FLOAT
+  for (int i = 0 ; i < number ; i++){
+    double d;
+    memcpy(&d, src + sizeof(double) * i, sizeof(double));
+    dst[i] = (item_t)d;
+  }
+#else
+  memcpy(dst, src, sizeof(double) * number);
+#endif
+}
+
+Itemset *load_itemset(char *filename)
+{
+  MappedFile file;
+  uint64_t count;
+  int legacy;
+  const char *data = (const char*)map_instance(filename, BIN_ITEM_F64, &file, &count, NULL, NULL, &legacy);
+  if (count > INT_MAX){
+    fprintf(stderr, "%s: too many items (%llu).\n", filename, (unsigned long long)count);
+    exit(1);
+  }
+  printf("open file %s\n",filename);
+  const int number = (int)count;
+  // 重さの配列の始まり (バージョン付きの形式では価値の配列を64バイトの倍数に切り上げた後ろ)
+  const size_t weight_offset = legacy ? sizeof(double) * number : bin_payload_size(BIN_ITEM_F64, count) / 2;
+#ifndef ITEM_FLOAT
+  if (!legacy){
+    Itemset *list = (Itemset*)malloc(sizeof(Itemset));
+    *list = (Itemset){.number = number, .value = (const item_t*)data, .weight = (const item_t*)(data + weight_offset),
+                      .block = NULL, .file = file};
+    return list;
+  }
+#endif
+  Itemset *list = new_itemset(number);
+  copy_items(writable_items(list, list->value), data, number);
+  copy_items(writable_items(list, list->weight), data + weight_offset, number);
+  unmap_file(&file);
+  return list;
+}
+
+// 価値か重さの配列を、doubleにして64バイトの倍数まで詰め物をして書く
+static int write_items(const item_t *src, int number, FILE *fp, uint32_t *crc)
+{
+  double buf[512];
+  const int padded = (number + 7) / 8 * 8;
+  for (int i = 0 ; i < padded ; ){
+    const int m = (padded - i < 512) ? padded - i : 512;
+    for (int j = 0 ; j < m ; j++) buf[j] = (i + j < number) ? src[i + j] : 0.0;
+    if (fwrite(buf, sizeof(double), m, fp) != (size_t)m) return 0;
+    *crc = crc32_update(*crc, buf, sizeof(double) * m);
+    i += m;
+  }
+  return 1;
+}
+
+int save_itemset(const Itemset *list, const char *filename)
+{
+  FILE *fp;
+  if ((fp = fopen(filename, "wb")) == NULL) return 0;
+  BinHeader h = bin_header(BIN_ITEM_F64, list->number, 0);
+  uint32_t crc = 0;
+  int ok = write_bin_header(fp, &h, "")
+    && write_items(list->value, list->number, fp, &crc)
+    && write_items(list->weight, list->number, fp, &crc);
+  // CRCが分かったのでヘッダを書き直す
+  h.crc32 = crc;
+  h.flags |= BIN_HAS_CRC;
+  ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(BinHeader), 1, fp) == 1;
+  return (fclose(fp) == 0) && ok;
+}
+
 // itemset の free関数
 void free_itemset(Itemset *list)
 {
-  free(list->item);
+  free(list->block);
+  unmap_file(&list->file);
   free(list);
 }
 
@@ -238,65 +603,592 @@ void print_itemset(const Itemset *list)
   int n = list->number;
   const char *format = "v[%d] = %4.1f, w[%d] = %4.1f\n";
   for(int i = 0 ; i < n ; i++){
-    printf(format, i, list->item[i].value, i, list->item[i].weight);
+    printf(format, i, list->value[i], i, list->weight[i]);
   }
   printf("----\n");
 }
 
+// ビット列の操作
+static size_t bits_words(int n)
+{
+  return (size_t)(n + 63) / 64;
+}
+
+static int bits_get(const Bits *b, int i)
+{
+  return (b[i / 64] >> (i % 64)) & 1;
+}
+
+static void bits_set(Bits *b, int i, int on)
+{
+  if (on) b[i / 64] |= (Bits)1 << (i % 64);
+  else b[i / 64] &= ~((Bits)1 << (i % 64));
+}
+
+// ビット列を表示・返り値用のフラグ配列に直す
+static char *bits_to_flags(const Bits *b, int n)
+{
+  char *flags = (char*)scratch_alloc(sizeof(char) * n);
+  for (int i = 0 ; i < n ; i++) flags[i] = bits_get(b, i);
+  return flags;
+}
+
+// 選び方の価値・重さをまとめて足し込む: out[j] += (masks[j] の i ビット目) * x[i]
+//  内側のループは選び方について回り分岐もないので、SIMD命令にできる (-O3 か -O2 -ftree-vectorize)。
+//  入れない品物は0を足すだけなので、1つずつ足したときと同じ値になる
+static void eval_block(const item_t *value, const item_t *weight, int k,
+                       const uint64_t *masks, int count, double *out_v, double *out_w)
+{
+  for (int i = 0 ; i < k ; i++){
+    const double vi = value[i], wi = weight[i];
+    for (int j = 0 ; j < count ; j++){
+      const double on = (int)((masks[j] >> i) & 1);
+      out_v[j] += on * vi;
+      out_w[j] += on * wi;
+    }
+  }
+}
+
 // ソルバーは search を index = 0 で呼び出すだけ
-Answer solve(const Itemset *list,  double capacity)
+Answer solve(const Itemset *list,  double capacity, TraceSink trace)
+{
+  const int n = list->number;
+  // 品物を入れたかどうかを記録するビット列 (探索中に書き換えていく)
+  Bits *flags = (Bits*)scratch_alloc(sizeof(Bits) * bits_words(n));
+  // 暫定解は何も入れない状態から始める
+  SearchState st = {.best_value = 0, .best = (Bits*)scratch_alloc(sizeof(Bits) * bits_words(n)),
+                    .trace = trace, .leaves = 0, .shared = NULL, .rest = NULL};
+  const double start = now_sec();
+  search(0,list,capacity,flags, 0.0, 0.0, &st);
+  const double sec = now_sec() - start;
+  fprintf(stderr, "search: %lld leaves in %.3f s (%.0f leaves/s)\n",
+          st.leaves, sec, (sec > 0) ? st.leaves / sec : 0.0);
+  Answer ans = {.count_value = st.best_value, .flags = bits_to_flags(st.best, n)};
+  scratch_free(st.best);
+  scratch_free(flags);
+  return ans;
+}
+
+// 葉: 確保はせず、暫定解よりよいときだけビット列(n/64語)を写す
+static void visit_leaf(const Itemset *list, double capacity, const Bits *flags, double sum_v, double sum_w, SearchState *st)
+{
+  const int max_index = list->number;
+  st->leaves++;
+  const int ok = (sum_w < capacity);
+  if (st->trace.fp != NULL && st->leaves % st->trace.every == 0){
+    const char *format_ok = ", total_value = %5.1f, total_weight = %5.1f\n";
+    const char *format_ng = ", total_value = %5.1f, total_weight = %5.1f NG\n";
+    for (int i = 0 ; i < max_index ; i++){
+      fprintf(st->trace.fp, "%d", bits_get(flags, i));
+    }
+    fprintf(st->trace.fp, ok ? format_ok : format_ng, sum_v, sum_w);
+  }
+  if (ok && sum_v > st->best_value){
+    st->best_value = sum_v;
+    memcpy(st->best, flags, sizeof(Bits) * bits_words(max_index));
+    if (st->shared != NULL){
+      double cur = atomic_load_explicit(st->shared, memory_order_relaxed);
+      while (sum_v > cur && !atomic_compare_exchange_weak(st->shared, &cur, sum_v));
+    }
+  }
+}
+
+// 最後の LEAF_BLOCK 個の品物は再帰せず、2^LEAF_BLOCK 通りの選び方をまとめて eval_block で評価する。
+//  全部入れても容量に収まるとき(どの葉にもたどり着くとき)だけ使い、葉は再帰と同じ順(入れない→入れる)に visit_leaf に渡す。
+//  容量がきついときは打ち切りの多い再帰の方が速い
+#define LEAF_BLOCK 6
+
+// 再帰では index の品物が一番上の分岐なので、葉の順番のビットを逆順にしたものが選び方になる
+#define REV2(x) (x), (x) + 32, (x) + 16, (x) + 48
+#define REV4(x) REV2(x), REV2((x) + 8), REV2((x) + 4), REV2((x) + 12)
+static const uint64_t leaf_order[1 << LEAF_BLOCK] = { REV4(0), REV4(2), REV4(1), REV4(3) };
+
+static void search_block(int index, const Itemset *list, double capacity, Bits *flags, double sum_v, double sum_w, SearchState *st)
 {
-  // 品物を入れたかどうかを記録するフラグ配列 => !!最大の組み合わせが返ってくる訳ではない!!
-  int *flags = (int*)calloc(list->number, sizeof(int));
-  Answer max_value = search(0,list,capacity,flags, 0.0, 0.0);
-  free(flags);
-  return max_value;
+  enum { LEAVES = 1 << LEAF_BLOCK };
+  double v[LEAVES], w[LEAVES];
+  for (int t = 0 ; t < LEAVES ; t++){
+    v[t] = sum_v;
+    w[t] = sum_w;
+  }
+  eval_block(list->value + index, list->weight + index, LEAF_BLOCK, leaf_order, LEAVES, v, w);
+  for (int t = 0 ; t < LEAVES ; t++){
+    // フラグを書くのは、書き出す葉と暫定解を更新する葉だけ
+    const int due = (st->trace.fp != NULL && (st->leaves + 1) % st->trace.every == 0);
+    if (!due && !(v[t] > st->best_value)){
+      st->leaves++;
+      continue;
+    }
+    for (int b = 0 ; b < LEAF_BLOCK ; b++) bits_set(flags, index + b, (leaf_order[t] >> b) & 1);
+    visit_leaf(list, capacity, flags, v[t], w[t], st);
+  }
+  for (int b = 0 ; b < LEAF_BLOCK ; b++) bits_set(flags, index + b, 0);
 }
 
 // 再帰的な探索関数
-Answer search(int index, const Itemset *list, double capacity, int *flags, double sum_v, double sum_w)
+void search(int index, const Itemset *list, double capacity, Bits *flags, double sum_v, double sum_w, SearchState *st)
 {
   int max_index = list->number;
   assert(index >= 0 && sum_v >= 0 && sum_w >= 0);
   // 必ず再帰の停止条件を明記する (最初が望ましい)
   if (index == max_index){
-    const char *format_ok = ", total_value = %5.1f, total_weight = %5.1f\n";
-    for (int i = 0 ; i < max_index ; i++){
-      printf("%d", flags[i]);
+    visit_leaf(list, capacity, flags, sum_v, sum_w, st);
+    return;
+  }
+  // 並列探索: 残りを全部入れても他のスレッドの暫定解に届かないなら調べない (同じ価値は調べる)
+  if (st->shared != NULL &&
+      sum_v + st->rest[index] < atomic_load_explicit(st->shared, memory_order_relaxed)) return;
+  if (max_index - index == LEAF_BLOCK){
+    double all_w = sum_w; // 残りを全部入れたときの重さ (再帰と同じ順に足す)
+    for (int i = index ; i < max_index ; i++) all_w += list->weight[i];
+    if (all_w < capacity){
+      search_block(index, list, capacity, flags, sum_v, sum_w, st);
+      return;
     }
-    if (sum_w < capacity){
-      printf(format_ok, sum_v, sum_w);
+  }
+
+  // 以下は再帰の更新式: 現在のindex の品物を使う or 使わないで分岐し、index をインクリメントして再帰的にsearch() を実行する
+  
+  bits_set(flags, index, 0);
+  search(index+1, list, capacity, flags, sum_v, sum_w, st);
 
-      char *flags_char= (char*)malloc(sizeof(char)*100);
-      for (int i = 0 ; i < max_index ; i++){
-        flags_char[i]=flags[i];
+  // 入れても容量を超えないときだけ、使った場合を調べる
+  if (sum_w + list->weight[index]<capacity){
+    bits_set(flags, index, 1);
+    search(index+1, list, capacity, flags , sum_v + list->value[index], sum_w + list->weight[index], st);
+  }
+  bits_set(flags, index, 0);
+}
+
+// 並列探索のタスク: 上から depth 個の品物の選び方
+typedef struct
+{
+  Bits prefix;  // 入れた品物 (depth <= 20 なので1語で足りる)
+  double sum_v;
+  double sum_w;
+} SearchTask;
+
+typedef struct
+{
+  const Itemset *list;
+  double capacity;
+  int depth;
+  const SearchTask *tasks;
+  int ntasks;
+  atomic_int next;        // 次に取るタスクの番号
+  _Atomic double best;    // 全スレッドの暫定解の最大価値
+  const double *rest;
+  double *task_value;     // タスクごとの最大価値
+  Bits *task_best;        // タスクごとの最適な選び方 (words 語ずつ)
+  size_t words;
+} ParSearch;
+
+typedef struct
+{
+  ParSearch *ps;
+  Bits *flags;      // このスレッドの作業用ビット列
+  long long leaves;
+} ParWorker;
+
+// 上から depth 個の選び方を、逐次のsearchがたどる順(入れない→入れる)に並べる
+static void make_tasks(const Itemset *list, double capacity, int index, int depth,
+                       Bits prefix, double sum_v, double sum_w, SearchTask *tasks, int *count)
+{
+  if (index == depth){
+    tasks[(*count)++] = (SearchTask){.prefix = prefix, .sum_v = sum_v, .sum_w = sum_w};
+    return;
+  }
+  make_tasks(list, capacity, index + 1, depth, prefix, sum_v, sum_w, tasks, count);
+  const double wi = list->weight[index], vi = list->value[index];
+  if (sum_w + wi < capacity){
+    make_tasks(list, capacity, index + 1, depth, prefix | (Bits)1 << index,
+               sum_v + vi, sum_w + wi, tasks, count);
+  }
+}
+
+static void *par_search_worker(void *arg)
+{
+  ParWorker *w = (ParWorker*)arg;
+  ParSearch *ps = w->ps;
+  int t;
+  while ((t = atomic_fetch_add(&ps->next, 1)) < ps->ntasks){
+    const SearchTask *task = &ps->tasks[t];
+    SearchState st = {.best_value = 0, .best = &ps->task_best[t * ps->words],
+                      .trace = {.fp = NULL, .every = 1}, .leaves = 0,
+                      .shared = &ps->best, .rest = ps->rest};
+    memset(w->flags, 0, sizeof(Bits) * ps->words);
+    w->flags[0] = task->prefix;
+    search(ps->depth, ps->list, ps->capacity, w->flags, task->sum_v, task->sum_w, &st);
+    ps->task_value[t] = st.best_value;
+    w->leaves += st.leaves;
+  }
+  return NULL;
+}
+
+Answer solve_par(const Itemset *list, double capacity, int threads)
+{
+  const int n = list->number;
+  // タスクがスレッド数の16倍くらいになる深さまで分ける
+  int depth = 0;
+  while (depth < n && depth < 20 && (1 << depth) < threads * 16) depth++;
+
+  ParSearch ps = {.list = list, .capacity = capacity, .depth = depth, .ntasks = 0,
+                  .words = bits_words(n)};
+  atomic_init(&ps.next, 0);
+  atomic_init(&ps.best, 0.0);
+  // スレッドを立てる前に全て確保しておく (scratch_alloc はスレッドから呼ばない)
+  SearchTask *tasks = (SearchTask*)scratch_alloc(sizeof(SearchTask) << depth);
+  make_tasks(list, capacity, 0, depth, 0, 0.0, 0.0, tasks, &ps.ntasks);
+  ps.tasks = tasks;
+  double *rest = (double*)scratch_alloc(sizeof(double) * (n + 1));
+  for (int i = n - 1 ; i >= 0 ; i--) rest[i] = rest[i + 1] + list->value[i];
+  ps.rest = rest;
+  ps.task_value = (double*)scratch_alloc(sizeof(double) * ps.ntasks);
+  ps.task_best = (Bits*)scratch_alloc(sizeof(Bits) * ps.words * ps.ntasks);
+  ParWorker *workers = (ParWorker*)scratch_alloc(sizeof(ParWorker) * threads);
+  pthread_t *tid = (pthread_t*)scratch_alloc(sizeof(pthread_t) * threads);
+  for (int i = 0 ; i < threads ; i++){
+    workers[i] = (ParWorker){.ps = &ps, .flags = (Bits*)scratch_alloc(sizeof(Bits) * ps.words), .leaves = 0};
+  }
+
+  const double start = now_sec();
+  for (int i = 0 ; i < threads ; i++){
+    if (pthread_create(&tid[i], NULL, par_search_worker, &workers[i]) != 0){
+      fprintf(stderr, "cannot create a thread.\n");
+      exit(1);
     }
+  }
+  long long leaves = 0;
+  for (int i = 0 ; i < threads ; i++){
+    pthread_join(tid[i], NULL);
+    leaves += workers[i].leaves;
+  }
+  const double sec = now_sec() - start;
+  fprintf(stderr, "search: %lld leaves in %.3f s (%.0f leaves/s, %d threads, %d tasks)\n",
+          leaves, sec, (sec > 0) ? leaves / sec : 0.0, threads, ps.ntasks);
 
-      return (Answer){ .count_value = sum_v, .flags=flags_char};
-    } 
+  // 最大価値のタスクのうち番号が最小のもの (逐次のsearchが最初に見つけるもの) を選ぶ
+  int best = -1;
+  for (int t = 0 ; t < ps.ntasks ; t++){
+    if (ps.task_value[t] > 0 && (best < 0 || ps.task_value[t] > ps.task_value[best])) best = t;
+  }
+  Answer ans = {.count_value = 0, .flags = NULL};
+  if (best >= 0){
+    ans = (Answer){.count_value = ps.task_value[best], .flags = bits_to_flags(&ps.task_best[best * ps.words], n)};
+  } else {
+    ans.flags = (char*)scratch_alloc(sizeof(char) * n);
   }
 
-  // 以下は再帰の更新式: 現在のindex の品物を使う or 使わないで分岐し、index をインクリメントして再帰的にsearch() を実行する
-  
-  flags[index] = 0;
-  Answer v0= search(index+1, list, capacity, flags, sum_v, sum_w );
-  
+  for (int i = 0 ; i < threads ; i++) scratch_free(workers[i].flags);
+  scratch_free(tid);
+  scratch_free(workers);
+  scratch_free(ps.task_best);
+  scratch_free(ps.task_value);
+  scratch_free(rest);
+  scratch_free(tasks);
+  return ans;
+}
+
+// 動的計画法でどの品物を入れたかを記録するビット列 (rows x cols ビット)
+typedef struct
+{
+  size_t words; // 1行の64bit語の数
+  uint64_t *bits;
+} BitTable;
+
+static BitTable new_bit_table(size_t rows, size_t cols)
+{
+  const size_t words = (cols + 63) / 64;
+  uint64_t *bits = (uint64_t*)scratch_alloc(sizeof(uint64_t) * rows * words);
+  return (BitTable){.words = words, .bits = bits};
+}
+
+static void bit_set(BitTable *t, size_t r, size_t c)
+{
+  t->bits[r * t->words + c / 64] |= (uint64_t)1 << (c % 64);
+}
+
+static int bit_get(const BitTable *t, size_t r, size_t c)
+{
+  return (t->bits[r * t->words + c / 64] >> (c % 64)) & 1;
+}
+
+// フラグから価値の合計を計算し直す (整数に直したときの誤差を含めないため)
+static double sum_value(const Itemset *list, const char *flags)
+{
+  double v = 0;
+  for (int i = 0 ; i < list->number ; i++){
+    if (flags[i]) v += list->value[i];
+  }
+  return v;
+}
+
+Answer solve_dp(const Itemset *list, double capacity, double scale)
+{
+  const int n = list->number;
+  // 重さの合計が capacity 未満 <=> 整数に直した重さの合計が C 以下
+  const double cs = ceil(capacity * scale - 1e-9) - 1;
+  if (cs > 1e9){
+    fprintf(stderr, "capacity %.1f x scale %.1f is too large for dp. use -m dpv.\n", capacity, scale);
+    exit(1);
+  }
+  const long C = (cs < 0) ? -1 : (long)cs;
+  char *flags = (char*)scratch_alloc(sizeof(char) * n);
+  if (C < 0) return (Answer){.count_value = 0, .flags = flags}; // 何も入らない
+
+  long *w = (long*)scratch_alloc(sizeof(long) * n);
+  for (int i = 0 ; i < n ; i++) w[i] = (long)ceil(list->weight[i] * scale - ITEM_EPS);
 
-  flags[index] = 1;
+  fprintf(stderr, "dp: capacity %ld, %.1f MB\n", C,
+          (sizeof(double) * (C + 1) + (double)n * ((C + 64) / 64) * 8) / (1024.0 * 1024.0));
+  double *dp = (double*)scratch_alloc(sizeof(double) * (C + 1));
+  BitTable take = new_bit_table(n, C + 1);
+  for (int i = 0 ; i < n ; i++){
+    const double v = list->value[i];
+    for (long c = C ; c >= w[i] ; c--){
+      if (dp[c - w[i]] + v > dp[c]){
+        dp[c] = dp[c - w[i]] + v;
+        bit_set(&take, i, c);
+      }
+    }
+  }
+
+  // 後ろの品物から、入れたかどうかをたどり直す
+  long c = C;
+  for (int i = n - 1 ; i >= 0 ; i--){
+    if (bit_get(&take, i, c)){
+      flags[i] = 1;
+      c -= w[i];
+    }
+  }
+  scratch_free(take.bits);
+  scratch_free(dp);
+  scratch_free(w);
+  return (Answer){.count_value = sum_value(list, flags), .flags = flags};
+}
 
+Answer solve_dpv(const Itemset *list, double capacity, double scale)
+{
+  const int n = list->number;
+  long *v = (long*)scratch_alloc(sizeof(long) * n);
+  long V = 0;
+  for (int i = 0 ; i < n ; i++){
+    v[i] = llround(list->value[i] * scale);
+    V += v[i];
+  }
+  if (V > 1000000000L){
+    fprintf(stderr, "total value %ld is too large for dpv. use a smaller scale.\n", V);
+    exit(1);
+  }
 
-  Answer v1= (Answer){ .count_value = 0};
+  fprintf(stderr, "dpv: total value %ld, %.1f MB\n", V,
+          (sizeof(double) * (V + 1) + (double)n * ((V + 64) / 64) * 8) / (1024.0 * 1024.0));
+  double *minw = (double*)scratch_alloc(sizeof(double) * (V + 1));
+  minw[0] = 0;
+  for (long x = 1 ; x <= V ; x++) minw[x] = HUGE_VAL;
+  BitTable take = new_bit_table(n, V + 1);
+  long reach = 0; // ここまでの品物で届く価値の上限
+  for (int i = 0 ; i < n ; i++){
+    const double w = list->weight[i];
+    reach += v[i];
+    if (v[i] == 0) continue; // 価値0の品物は入れても得をしない
+    for (long x = reach ; x >= v[i] ; x--){
+      if (minw[x - v[i]] + w < minw[x]){
+        minw[x] = minw[x - v[i]] + w;
+        bit_set(&take, i, x);
+      }
+    }
+  }
 
-  if (sum_w + list->item[index].weight<capacity){
-    v1= search(index+1, list, capacity, flags , sum_v + list->item[index].value, sum_w + list->item[index].weight);
-  }else{
-    v1= (Answer){ .count_value = 0};
+  // 容量未満で得られる一番大きな価値を探して、たどり直す
+  // 重さの和はdoubleの誤差を含むので、容量ちょうどのものを「未満」と見なさないように少し余裕をとる
+  const double limit = capacity - 1e-9 * (capacity > 1 ? capacity : 1);
+  long best = 0;
+  for (long x = V ; x > 0 ; x--){
+    if (minw[x] < limit){
+      best = x;
+      break;
+    }
   }
-  // 使った場合の結果と使わなかった場合の結果を比較して返す
-if (v0.count_value < v1.count_value) {
-  free(v0.flags);
-}else{
-  free(v1.flags);
+  char *flags = (char*)scratch_alloc(sizeof(char) * n);
+  long x = best;
+  for (int i = n - 1 ; i >= 0 ; i--){
+    if (x > 0 && bit_get(&take, i, x)){
+      flags[i] = 1;
+      x -= v[i];
+    }
+  }
+  scratch_free(take.bits);
+  scratch_free(minw);
+  scratch_free(v);
+  return (Answer){.count_value = sum_value(list, flags), .flags = flags};
+}
+
+// 分枝限定法の状態
+typedef struct
+{
+  const Itemset *list;
+  double capacity;
+  int *order;       // 価値/重さ の大きい順に並べた品物の番号
+  Bits *flags;      // 今の選び方 (元の番号で)
+  double best_value; // 暫定解の価値
+  Bits *best;       // 暫定解
+  long long nodes;  // 調べた節点の数
+} KnapsackBB;
+
+typedef struct
+{
+  double ratio;
+  int index;
+} Ratio;
+
+// 価値/重さ の大きい順
+static int compare_ratio(const void *a, const void *b)
+{
+  const double ra = ((const Ratio*)a)->ratio, rb = ((const Ratio*)b)->ratio;
+  if (ra != rb) return (ra > rb) ? -1 : 1;
+  return ((const Ratio*)a)->index - ((const Ratio*)b)->index;
+}
+
+// order[k]以降の品物で、残りの容量roomを分数も許して詰めたときの価値の上限
+static double fractional_bound(const KnapsackBB *bb, int k, double sum_v, double room)
+{
+  const int n = bb->list->number;
+  double v = sum_v;
+  for (int t = k ; t < n ; t++){
+    const double wi = bb->list->weight[bb->order[t]], vi = bb->list->value[bb->order[t]];
+    if (wi <= room){
+      room -= wi;
+      v += vi;
+    } else {
+      v += vi * room / wi; // 入りきらない品物は入る分だけ
+      break;
+    }
+  }
+  return v;
+}
+
+static void bb_search(KnapsackBB *bb, int k, double sum_v, double sum_w)
+{
+  const int n = bb->list->number;
+  bb->nodes++;
+  // どの節点でも、まだ決めていない品物を全て入れなければ実行可能な解になっている
+  if (sum_v > bb->best_value){
+    bb->best_value = sum_v;
+    memcpy(bb->best, bb->flags, sizeof(Bits) * bits_words(n));
+  }
+  if (k == n) return;
+  // 限定: 分数を許しても暫定解を超えられないならこの先は調べない
+  if (fractional_bound(bb, k, sum_v, bb->capacity - sum_w) <= bb->best_value + 1e-12) return;
+
+  const int i = bb->order[k];
+  const double wi = bb->list->weight[i], vi = bb->list->value[i];
+  if (sum_w + wi < bb->capacity){
+    bits_set(bb->flags, i, 1);
+    bb_search(bb, k + 1, sum_v + vi, sum_w + wi);
+    bits_set(bb->flags, i, 0);
+  }
+  bb_search(bb, k + 1, sum_v, sum_w);
+}
+
+Answer solve_bb(const Itemset *list, double capacity)
+{
+  const int n = list->number;
+  Ratio *r = (Ratio*)scratch_alloc(sizeof(Ratio) * n);
+  for (int i = 0 ; i < n ; i++){
+    const double wi = list->weight[i], vi = list->value[i];
+    r[i] = (Ratio){.ratio = (wi > 0) ? vi / wi : HUGE_VAL, .index = i};
+  }
+  qsort(r, n, sizeof(Ratio), compare_ratio);
+
+  KnapsackBB bb = {.list = list, .capacity = capacity, .nodes = 0};
+  bb.order = (int*)scratch_alloc(sizeof(int) * n);
+  for (int t = 0 ; t < n ; t++) bb.order[t] = r[t].index;
+  scratch_free(r);
+  bb.flags = (Bits*)scratch_alloc(sizeof(Bits) * bits_words(n));
+  bb.best_value = 0;
+  bb.best = (Bits*)scratch_alloc(sizeof(Bits) * bits_words(n));
+
+  const double start = now_sec();
+  bb_search(&bb, 0, 0.0, 0.0);
+  fprintf(stderr, "bb: %lld nodes in %.3f s\n", bb.nodes, now_sec() - start);
+
+  Answer ans = {.count_value = bb.best_value, .flags = bits_to_flags(bb.best, n)};
+  scratch_free(bb.order);
+  scratch_free(bb.flags);
+  scratch_free(bb.best);
+  return ans;
+}
+
+// 半分全列挙で使う、品物の部分集合
+typedef struct
+{
+  double weight;
+  double value;
+  uint64_t mask; // 入れた品物 (品物i は i ビット目)
+} Subset;
+
+// 品物 [from, to) の選び方のうち、容量に収まりパレート最適なものを重さの小さい順に並べる
+//  品物を1つずつ加えながら「入れない列」と「入れる列」を重さ順にマージし、
+//  それまでに残したものより価値が大きいものだけを残す (2^(to-from) 個を並べ替えずに済む)
+static Subset *pareto_frontier(const Itemset *list, int from, int to, double capacity, size_t *count)
+{
+  size_t len = 0;
+  Subset *front = (Subset*)scratch_alloc(sizeof(Subset));
+  if (0.0 < capacity) front[len++] = (Subset){.weight = 0, .value = 0, .mask = 0};
+
+  for (int i = from ; i < to ; i++){
+    const double wi = list->weight[i], vi = list->value[i];
+    Subset *next = (Subset*)scratch_alloc(sizeof(Subset) * 2 * (len + 1));
+    size_t a = 0, b = 0, m = 0;
+    while (a < len || b < len){
+      Subset s;
+      if (b >= len || (a < len && front[a].weight <= front[b].weight + wi)){
+        s = front[a++];
+      } else {
+        s = (Subset){.weight = front[b].weight + wi, .value = front[b].value + vi,
+                     .mask = front[b].mask | (uint64_t)1 << i};
+        b++;
+        if (!(s.weight < capacity)) continue; // 入らない (これより後も重いだけ)
+      }
+      if (m > 0 && s.value <= next[m - 1].value) continue; // 軽いもので同じ価値以上が取れる
+      next[m++] = s;
+    }
+    scratch_free(front);
+    front = next;
+    len = m;
+  }
+  *count = len;
+  return front;
+}
+
+Answer solve_mitm(const Itemset *list, double capacity)
+{
+  const int n = list->number;
+  const int half = n / 2;
+  const double start = now_sec();
+  size_t na, nb;
+  Subset *a = pareto_frontier(list, 0, half, capacity, &na);
+  Subset *b = pareto_frontier(list, half, n, capacity, &nb);
+
+  // aは軽い順、bは重い順にたどる: aが重くなるほど組めるbの上限は軽くなる
+  double best_value = 0;
+  uint64_t best_mask = 0;
+  size_t j = nb;
+  for (size_t i = 0 ; i < na && j > 0 ; i++){
+    while (j > 0 && !(a[i].weight + b[j - 1].weight < capacity)) j--;
+    if (j == 0) break;
+    const double v = a[i].value + b[j - 1].value;
+    if (v > best_value){
+      best_value = v;
+      best_mask = a[i].mask | b[j - 1].mask;
+    }
+  }
+  fprintf(stderr, "mitm: frontiers %zu + %zu subsets in %.3f s\n", na, nb, now_sec() - start);
+
+  char *flags = (char*)scratch_alloc(sizeof(char) * n);
+  for (int i = 0 ; i < n ; i++) flags[i] = (best_mask >> i) & 1;
+  scratch_free(a);
+  scratch_free(b);
+  return (Answer){.count_value = best_value, .flags = flags};
 }
-  return  (v0.count_value > v1.count_value) ? v0 : v1;
-}   
\ No newline at end of file
@@ -0,0 +1,215 @@
+// mapfile.h: 町・品物のバイナリファイルをmmapで読み書きするための共通関数
+// gencity.c, tsp.c, tsp_jishu3.c, knapsack.c から #include して使う (関数はすべてstatic inline)
+//
+// ファイルの形式は2つある
+//  従来の形式: 要素数(int) の後に要素が並ぶだけ。
+//   ファイルの大きさが 4 + 要素数 x 要素の大きさ になっているかを確かめてから、要素の先頭を返す。
+//  バージョン付きの形式 (BinHeader): 64バイトのヘッダ, メタデータ(文字列), 64バイト境界から要素。
+//   要素の種類・大きさ・バイト順・64ビットの要素数・CRC32を持つので、取り違えや壊れたファイルを検出でき、
+//   要素はmmapした領域をそのまま配列として使える。
+//  freadのように1つずつ読んでコピーすることはせず、ページは触ったときにOSが読み込む
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>    // open
+#include <unistd.h>   // close
+#include <sys/mman.h> // mmap, munmap
+#include <sys/stat.h> // fstat
+
+// mmapしたファイル
+typedef struct
+{
+  void *addr;
+  size_t size;
+} MappedFile;
+
+// ファイル全体を読み込み専用でmmapする (開けないときは終了する)
+static inline MappedFile map_file(const char *filename)
+{
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0){
+    fprintf(stderr, "%s: cannot open file. (%s)\n", filename, strerror(errno));
+    exit(1);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0){
+    fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  MappedFile m = {.addr = NULL, .size = (size_t)st.st_size};
+  if (m.size > 0){
+    m.addr = mmap(NULL, m.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m.addr == MAP_FAILED){
+      fprintf(stderr, "%s: cannot mmap. (%s)\n", filename, strerror(errno));
+      exit(1);
+    }
+    madvise(m.addr, m.size, MADV_SEQUENTIAL); // 先の方のページも先読みさせる
+  }
+  close(fd); // mmapした領域はfdを閉じても使える
+  return m;
+}
+
+static inline void unmap_file(MappedFile *m)
+{
+  if (m->addr != NULL) munmap(m->addr, m->size);
+  m->addr = NULL;
+  m->size = 0;
+}
+
+// 要素数(int)の後に elem_size バイトの要素が並ぶファイルをmmapし、要素の先頭を返す
+//  要素数は *count に入れる。ファイルの大きさと要素数が合わないときは終了する
+static inline const void *map_counted(const char *filename, size_t elem_size, MappedFile *m, int *count)
+{
+  *m = map_file(filename);
+  int number;
+  if (m->size < sizeof(int)){
+    fprintf(stderr, "%s: too short (%zu bytes).\n", filename, m->size);
+    exit(1);
+  }
+  memcpy(&number, m->addr, sizeof(int));
+  if (number <= 0 || (m->size - sizeof(int)) / elem_size != (size_t)number
+      || (m->size - sizeof(int)) % elem_size != 0){
+    fprintf(stderr, "%s: the header says %d elements but the file has %zu bytes.\n",
+            filename, number, m->size);
+    exit(1);
+  }
+  *count = number;
+  return (const char*)m->addr + sizeof(int);
+}
+
+// バージョン付きの形式のヘッダ (64バイト, 書いた機械のバイト順)
+#define BIN_MAGIC "SOFT2BIN"
+#define BIN_VERSION 1
+#define BIN_ENDIAN 0x01020304u
+#define BIN_HAS_CRC 1u // flags: crc32 が記録されている
+
+// 要素の種類
+typedef enum
+{
+  BIN_CITY_I32 = 1, // 町: int32 の x, y (8バイト)
+  BIN_ITEM_F64 = 2, // 品物: double の価値の配列, double の重さの配列 (それぞれ64バイトの倍数に詰め物をする)
+} BinType;
+
+typedef struct
+{
+  char magic[8];           // "SOFT2BIN"
+  uint32_t version;        // BIN_VERSION
+  uint32_t type;           // BinType
+  uint64_t count;          // 要素数
+  uint32_t elem_size;      // 要素1つのバイト数
+  uint32_t endian;         // BIN_ENDIAN (読んで値が違えばバイト順が違う)
+  uint32_t meta_size;      // ヘッダの直後のメタデータのバイト数
+  uint32_t crc32;          // 要素部分のCRC32
+  uint64_t payload_offset; // 要素の先頭 (64の倍数)
+  uint64_t payload_size;   // 要素部分のバイト数
+  uint32_t flags;          // BIN_HAS_CRC
+  uint32_t reserved;
+} BinHeader;
+
+_Static_assert(sizeof(BinHeader) == 64, "BinHeader must be 64 bytes");
+
+// CRC32 (IEEE 802.3, zlibと同じ)。crc = 0 から始めて、続けて呼べば全体のCRCになる
+static inline uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+  static uint32_t table[256];
+  if (table[1] == 0){
+    for (uint32_t i = 0 ; i < 256 ; i++){
+      uint32_t c = i;
+      for (int k = 0 ; k < 8 ; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+  }
+  const unsigned char *p = (const unsigned char*)buf;
+  crc = ~crc;
+  for (size_t i = 0 ; i < len ; i++) crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+// 要素部分の大きさ (品物は価値と重さの配列をそれぞれ64バイトの倍数に切り上げる)
+static inline uint64_t bin_payload_size(BinType type, uint64_t count)
+{
+  if (type == BIN_ITEM_F64) return 2 * ((count * sizeof(double) + 63) / 64 * 64);
+  return count * 2 * sizeof(int32_t);
+}
+
+// ヘッダを作る (crc32はまだ入れない)
+static inline BinHeader bin_header(BinType type, uint64_t count, uint32_t meta_size)
+{
+  BinHeader h = {.version = BIN_VERSION, .type = type, .count = count,
+                 .elem_size = (type == BIN_ITEM_F64) ? 2 * sizeof(double) : 2 * sizeof(int32_t),
+                 .endian = BIN_ENDIAN, .meta_size = meta_size, .crc32 = 0,
+                 .payload_offset = (sizeof(BinHeader) + meta_size + 63) / 64 * 64,
+                 .payload_size = bin_payload_size(type, count), .flags = 0, .reserved = 0};
+  memcpy(h.magic, BIN_MAGIC, sizeof(h.magic));
+  return h;
+}
+
+// ヘッダ, メタデータ, 要素の先頭までの詰め物を書く。書けなければ0を返す
+//  要素を書き終えたら、crc32とflagsを入れたヘッダをもう1度先頭に書き直す (fseek(fp, 0, SEEK_SET))
+static inline int write_bin_header(FILE *fp, const BinHeader *h, const char *meta)
+{
+  static const char zero[64];
+  if (fwrite(h, sizeof(BinHeader), 1, fp) != 1) return 0;
+  if (h->meta_size > 0 && fwrite(meta, 1, h->meta_size, fp) != h->meta_size) return 0;
+  const size_t pad = h->payload_offset - sizeof(BinHeader) - h->meta_size;
+  return fwrite(zero, 1, pad, fp) == pad;
+}
+
+// ファイルをmmapし、type の要素の先頭を返す。バージョン付きでも従来の形式でも読める
+//  要素数は *count に、メタデータがあれば *meta, *meta_size に入れる (なければNULL, 0)。
+//  従来の形式の品物はdoubleが8バイト境界にそろっていないので、呼び出し側でコピーする (*legacyが1になる)
+//  形式がおかしいとき、大きさが合わないとき、CRCが合わないときは終了する
+static inline const void *map_instance(const char *filename, BinType type, MappedFile *m, uint64_t *count,
+                                const char **meta, uint32_t *meta_size, int *legacy)
+{
+  *m = map_file(filename);
+  BinHeader h;
+  if (m->size < sizeof(BinHeader) || memcmp(m->addr, BIN_MAGIC, 8) != 0){
+    // 従来の形式
+    unmap_file(m);
+    int number;
+    const void *data = map_counted(filename, (type == BIN_ITEM_F64) ? 2 * sizeof(double) : 2 * sizeof(int32_t),
+                                   m, &number);
+    *count = (uint64_t)number;
+    if (meta != NULL) *meta = NULL;
+    if (meta_size != NULL) *meta_size = 0;
+    *legacy = 1;
+    return data;
+  }
+  memcpy(&h, m->addr, sizeof(BinHeader));
+  if (h.endian != BIN_ENDIAN){
+    fprintf(stderr, "%s: written on a machine with a different byte order.\n", filename);
+    exit(1);
+  }
+  if (h.version != BIN_VERSION){
+    fprintf(stderr, "%s: unsupported version %u.\n", filename, h.version);
+    exit(1);
+  }
+  if (h.type != (uint32_t)type){
+    fprintf(stderr, "%s: contains element type %u, but type %u is expected.\n", filename, h.type, (unsigned)type);
+    exit(1);
+  }
+  if (h.count == 0 || h.count > ((uint64_t)1 << 56) || h.payload_offset % 64 != 0 || h.payload_offset < sizeof(BinHeader) + h.meta_size
+      || h.payload_size != bin_payload_size(type, h.count) || h.payload_offset + h.payload_size != m->size){
+    fprintf(stderr, "%s: the header says %llu elements but the file has %zu bytes.\n",
+            filename, (unsigned long long)h.count, m->size);
+    exit(1);
+  }
+  const char *payload = (const char*)m->addr + h.payload_offset;
+  if ((h.flags & BIN_HAS_CRC) && crc32_update(0, payload, h.payload_size) != h.crc32){
+    fprintf(stderr, "%s: checksum mismatch (the file is broken).\n", filename);
+    exit(1);
+  }
+  *count = h.count;
+  if (meta != NULL) *meta = (h.meta_size > 0) ? (const char*)m->addr + sizeof(BinHeader) : NULL;
+  if (meta_size != NULL) *meta_size = h.meta_size;
+  *legacy = 0;
+  return payload;
+}
+
+#endif
@@ -1,11 +1,16 @@
+// コンパイル: gcc -O2 -pthread tsp.c -lm
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <math.h>
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h> // strtol のエラー判定用
 #include <time.h>
+#include <pthread.h>
+#include "mapfile.h"
 
 // 町の構造体（今回は2次元座標）を定義
 typedef struct
@@ -22,6 +27,150 @@ typedef struct
   char **dot;
 } Map;
 
+// 局所探索の種類
+typedef enum
+{
+  LS_YAMA,  // 0以外の2町の交換と2-optを全組み合わせで調べる (従来のyama)
+  LS_2OPT,  // 近傍リストとdon't-look bitを使った2-opt
+  LS_OROPT, // 上の2-optに加えて、長さ1~3の区間を別の場所に移すOr-opt
+  LS_LK,    // 2-optの代わりにLin-Kernighan風の可変深さの手 + Or-opt
+} LocalSearch;
+
+// 解き方 (-m オプション)
+typedef enum
+{
+  MT_RESTART, // シャッフルして局所探索をやり直す (従来の方法)
+  MT_SA,      // 焼きなまし法
+  MT_LK,      // 連鎖Lin-Kernighan (LKの局所探索 + double-bridgeのキック)
+  MT_GA,      // 遺伝的アルゴリズム (順序交叉 + 局所探索での修復)
+} Method;
+
+// 距離の持ち方 (-d オプション)
+typedef enum
+{
+  DC_AUTO,   // 都市数から自動で選ぶ
+  DC_NONE,   // 毎回sqrtで計算する
+  DC_DOUBLE, // n x n の密行列 (double)
+  DC_FLOAT,  // n x n の密行列 (float) メモリは半分
+  DC_INT,    // n x n の密行列 (四捨五入した整数距離, TSPLIBのEUC_2Dと同じ)
+  DC_CACHE,  // 必要になった組だけを覚えるハッシュ表 (大きなn向け)
+} DistMode;
+
+// 最初の経路の作り方 (-i オプション)
+typedef enum
+{
+  INIT_IDENTITY,    // 0, 1, 2, ..., n-1 の順 (従来の方法)
+  INIT_NN,          // 最近傍法: 今いる町から一番近いまだ訪れていない町へ進む
+  INIT_GREEDY,      // 貪欲法: 短い辺から順に、次数2以下で閉路にならないものを採る
+  INIT_HILBERT,     // ヒルベルト曲線の順に並べる
+  INIT_CHRISTOFIDES, // 最小全域木 + 奇点の貪欲マッチング + オイラー閉路の近道 (簡易版Christofides)
+} InitTour;
+
+// 町の空間索引の種類 (-g オプション)
+typedef enum
+{
+  IX_AUTO,   // 町の散らばり方から自動で選ぶ
+  IX_GRID,   // 一様な格子 (升目ごとに町を並べる。一様な配置向け)
+  IX_KDTREE, // k-d木 (偏った配置向け)
+} IndexKind;
+
+// k-d木の節。perm[lo..hi) の町を受け持ち、葉でなければ split で2つに分ける
+typedef struct
+{
+  int lo, hi;
+  int left, right; // 子の番号 (葉なら-1)
+  int parent;      // 親の番号 (根なら-1)
+  int dim;         // 分ける軸 (0: x, 1: y)
+  int split;       // 左の子の町は split 以下、右の子の町は split 以上
+  int alive;       // 取り除かれていない町の数 (0なら探さない)
+} KdNode;
+
+// 町の空間索引。一度作れば、最も近い町・近い順k個を線形探索なしで探せる
+// index_remove で町を取り除くと、以後の問い合わせでは見つからない (「まだ訪れていない最も近い町」に使う)
+typedef struct
+{
+  IndexKind kind;
+  const City *city;
+  int n;
+  char *removed;   // removed[c]: 町cを取り除いたか
+  // 格子 (IX_GRID)
+  int minx, miny;  // 町の座標の最小値 (格子の原点)
+  int gx, gy;      // 升目の数
+  int cell;        // 升目の1辺
+  int *start;      // 升目gの町は items[start[g] .. start[g] + count[g])
+  int *count;      // 升目ごとの取り除かれていない町の数
+  int *items;
+  int *slot;       // slot[c]: 町cの items での位置
+  // k-d木 (IX_KDTREE)
+  KdNode *node;    // node[0] が根
+  int *perm;
+  int *leaf;       // leaf[c]: 町cを含む葉の番号
+  int nnode;       // 節の数
+} SpatialIndex;
+
+// 2町間の距離のキャッシュ
+// 密行列は1行を64バイト(キャッシュライン)の倍数にそろえて確保する
+typedef struct
+{
+  double d;
+  int a; // a < b の組で覚える。未使用なら-1
+  int b;
+} DistEntry;
+
+typedef struct
+{
+  DistMode mode;
+  size_t stride;    // 密行列の1行の要素数
+  void *matrix;     // 密行列 (DC_DOUBLE / DC_FLOAT / DC_INT)
+  size_t mask;      // ハッシュ表 (DC_CACHE) の大きさ - 1
+} DistCache;
+
+// 距離キャッシュはプログラム全体で1つだけ持つ (init_dist_cache で作る)
+static DistCache dist_cache = {.mode = DC_NONE};
+// ハッシュ表は書き込みがあるのでスレッドごとに持つ (最初に引いたときに確保する)
+static _Thread_local DistEntry *dist_table = NULL;
+
+// solveに渡す設定 (コマンドライン引数から作る)
+typedef struct
+{
+  LocalSearch ls;
+  int k;        // 近傍リストに入れる近い町の数
+  int restarts; // 山登りをやり直す回数
+  DistMode dist; // 距離の持ち方
+  int threads;   // 山登りを並列に走らせるスレッド数
+  unsigned int seed; // 乱数のseed。同じseedとスレッド数なら同じ結果になる
+  Method method;     // 解き方
+  double time_limit; // 制限時間(秒)。0以下なら制限なし
+  IndexKind index;   // 近傍リストなどを作るときの空間索引
+  InitTour init;     // 最初の経路の作り方
+  int population;    // 遺伝的アルゴリズムの個体数
+} Config;
+
+// 各町から近い順にk個の町を並べたリスト (list[i*k + j] が町iのj番目に近い町)
+typedef struct
+{
+  int k;
+  int *list;
+} NeighborList;
+
+// スレッドごとに独立した乱数列 (xorshift64*)
+// rand()は全スレッドで状態を共有してしまうので使わない
+typedef struct
+{
+  uint64_t s;
+} Rng;
+
+// 山登りで使い回す作業領域 (スレッドごとに1つ)
+// 山登りのたびに確保し直したり、VLAでスタックに取ったりしないように、最初に1度だけ確保する
+typedef struct
+{
+  int *nowroute;   // シャッフルして山登りを始める経路
+  int *good_route; // 山登りで改善した経路
+  int *pos;    // pos[c]: 町cがrouteの何番目にいるか
+  int *queue;  // 調べ直す町の待ち行列 (循環バッファ)
+  char *queued; // don't-look bit の反対: 1なら待ち行列に入っている
+} Workspace;
+
 // 整数最大値をとる関数
 int max(const int a, const int b)
 {
@@ -33,17 +182,74 @@ int max(const int a, const int b)
 // draw_route: routeでの巡回順を元に移動経路を線で結ぶ
 // plot_cities: 描画する
 // distance: 2地点間の距離を計算
+// init_dist_cache / free_dist_cache: 距離キャッシュを作る/消す
+// free_dist_table: このスレッドのハッシュ表を消す
+// dist: 町番号a,bの距離をキャッシュから引く (solverの中では distance ではなくこちらを使う)
+// tour_length: routeでの巡回距離の総和を計算
+// swap_delta: 位置i,jの町を交換したときの距離の変化量 (O(1))
+// two_opt_delta: 位置i,jの後ろの辺を繋ぎ替える2-opt移動の距離の変化量 (O(1))
+// apply_swap / apply_two_opt: 上の移動をrouteにその場で適用する
 // solve(): TSPをといて距離を返す/ 引数route に巡回順を格納
+// build_neighbors: 空間索引を使って、各町の近い順k個のリストを作る
+// build_index / free_index: 町の空間索引 (格子かk-d木) を作る/消す
+// describe_index: 空間索引の種類と大きさを表示する
+// index_knn: 町cに近い順にk個の町 (c自身と取り除いた町は除く)
+// index_nearest: 町cに最も近い町 (なければ-1)
+// index_remove: 町cを索引から取り除く
+// construct_tour: init の方法で最初の経路を作る (0番目の町から始まる)
+// local_search: 近傍リストを使った2-opt (+Or-opt, LK) で route を局所最適まで改善する
+// yama: 交換と2-optの全探索で route を局所最適まで改善する
+// init_workspace / free_workspace: 山登りで使い回す作業領域を確保/解放する
+// rng_init / rng_next / rng_int: スレッドごとの乱数 (xorshift64*)
+// anneal: 焼きなまし法で route を改善する (近傍リストの2-optとOr-opt, 差分はO(1))
+// init_accept_table: 焼きなましの受理判定に使う exp の表を作る
+// chained_lk: 連鎖LK。局所最適に小さなdouble-bridgeのキックを入れては局所探索し直し、悪くなれば戻す
+// genetic: 遺伝的アルゴリズム。子の生成と修復を世代ごとにスレッドに分けて行う
+// now_sec: 単調増加する時計 (秒)
 
 void draw_line(Map map, City a, City b);
-void draw_route(Map map, City *city, int n, const int *route);
-void plot_cities(FILE* fp, Map map, City *city, int n, const int *route);
+void draw_route(Map map, const City *city, int n, const int *route);
+void plot_cities(FILE* fp, Map map, const City *city, int n, const int *route);
 double distance(City a, City b);
-double solve(const City *city, int n, int *route);
-void yama(const City *city, int n, int *route, int *nowroute,double *min);
+void init_dist_cache(const City *city, int n, DistMode mode, int threads);
+void free_dist_cache(void);
+void free_dist_table(void);
+static inline double dist(const City *city, int a, int b);
+double tour_length(const City *city, int n, const int *route);
+double swap_delta(const City *city, int n, const int *route, int i, int j);
+double two_opt_delta(const City *city, int n, const int *route, int i, int j);
+void apply_swap(int *route, int i, int j);
+void apply_two_opt(int *route, int i, int j);
+double solve(const City *city, int n, int *route, const Config *conf);
+NeighborList build_neighbors(const SpatialIndex *ix, int k);
+SpatialIndex build_index(const City *city, int n, IndexKind kind);
+void free_index(SpatialIndex *ix);
+void describe_index(const SpatialIndex *ix);
+int index_knn(const SpatialIndex *ix, int c, int k, int *out, double *d2);
+int index_nearest(const SpatialIndex *ix, int c);
+void index_remove(SpatialIndex *ix, int c);
+void construct_tour(const City *city, int n, InitTour init, IndexKind index, int *route);
+double local_search(const City *city, int n, int *route, const NeighborList *nl, Workspace *w, LocalSearch ls,
+                    double deadline);
+double yama(const City *city, int n, int *route);
+Workspace init_workspace(int n);
+Rng rng_init(uint64_t seed, uint64_t stream);
+uint64_t rng_next(Rng *r);
+int rng_int(Rng *r, int m);
+double anneal(const City *city, int n, int *route, const NeighborList *nl, Workspace *w, Rng *rng, double deadline);
+void init_accept_table(void);
+double chained_lk(const City *city, int n, int *route, const NeighborList *nl, Workspace *w, Rng *rng, double deadline);
+double now_sec(void);
+double genetic(const City *city, int n, int *best_route, const NeighborList *nl, const Config *conf, double deadline);
+void free_workspace(Workspace *w);
 Map init_map(const int width, const int height);
 void free_map_dot(Map m);
-City *load_cities(const char* filename,int *n);
+int fits_map(Map map, const City *city, int n);
+// 町のファイル(従来の形式かバージョン付きの形式)をmmapして、要素をそのままCityの配列として使う (コピーしない)
+//  使い終わったら unmap_file(file) する
+const City *load_cities(const char* filename,int *n,MappedFile *file);
+int load_int(const char *argvalue);
+double load_double(const char *argvalue);
 
 Map init_map(const int width, const int height)
 {
@@ -59,21 +265,62 @@ void free_map_dot(Map m)
   free(m.dot);
 }
 
-City *load_cities(const char *filename, int *n)
+// すべての町が番号付きで地図の中に描けるかどうか
+int fits_map(Map map, const City *city, int n)
+{
+  for (int i = 0 ; i < n ; i++){
+    char buf[100];
+    const int len = sprintf(buf, "C_%d", i);
+    if (city[i].x < 0 || city[i].x + len > map.width) return 0;
+    if (city[i].y < 0 || city[i].y >= map.height) return 0;
+  }
+  return 1;
+}
+
+int load_int(const char *argvalue)
+{
+  long nl;
+  char *e;
+  errno = 0; // errno.h で定義されているグローバル変数を一旦初期化
+  nl = strtol(argvalue,&e,10);
+  if (errno == ERANGE){
+    fprintf(stderr,"%s: %s\n",argvalue,strerror(errno));
+    exit(1);
+  }
+  if (*e != '\0'){
+    fprintf(stderr,"%s: an irregular character '%c' is detected.\n",argvalue,*e);
+    exit(1);
+  }
+  return (int)nl;
+}
+
+double load_double(const char *argvalue)
 {
-  City *city;
-  FILE *fp;
-  if ((fp=fopen(filename,"rb")) == NULL){
-    fprintf(stderr, "%s: cannot open file.\n",filename);
+  char *e;
+  errno = 0;
+  const double x = strtod(argvalue,&e);
+  if (errno == ERANGE){
+    fprintf(stderr,"%s: %s\n",argvalue,strerror(errno));
     exit(1);
   }
-  fread(n,sizeof(int),1,fp);
-  city = (City*)malloc(sizeof(City) * *n);
-  for (int i = 0 ; i < *n ; i++){
-    fread(&city[i].x, sizeof(int), 1, fp);
-    fread(&city[i].y, sizeof(int), 1, fp);
+  if (*e != '\0' || e == argvalue){
+    fprintf(stderr,"%s: not a number.\n",argvalue);
+    exit(1);
   }
-  fclose(fp);
+  return x;
+}
+
+const City *load_cities(const char *filename, int *n, MappedFile *file)
+{
+  // 従来の形式でもバージョン付きの形式でも、要素の並び (x_0, y_0, x_1, y_1, ...) はCityの配列と同じ
+  uint64_t count;
+  int legacy;
+  const City *city = (const City*)map_instance(filename, BIN_CITY_I32, file, &count, NULL, NULL, &legacy);
+  if (count > INT_MAX){
+    fprintf(stderr, "%s: too many cities (%llu).\n", filename, (unsigned long long)count);
+    exit(1);
+  }
+  *n = (int)count;
   return city;
 }
 int main(int argc, char**argv)
@@ -81,28 +328,139 @@ int main(int argc, char**argv)
   // const による定数定義
   const int width = 70;
   const int height = 40;
-  const int max_cities = 100;
 
   Map map = init_map(width, height);
   
   FILE *fp = stdout; // とりあえず描画先は標準出力としておく
-  if (argc != 2){
-    fprintf(stderr, "Usage: %s <city file>\n", argv[0]);
+  const char *usage = "Usage: %s [-m restart|sa|lk|ga] [-p population (ga only)] [-l yama|2opt|oropt|lk] [-k neighbors] [-r restarts (restart only)] [-T seconds] [-d auto|none|double|float|int|cache] [-g auto|grid|kdtree] [-i identity|nn|greedy|hilbert|christofides] [-t threads] [-s seed] <city file>\n";
+
+  // 既定は Or-opt 付きの局所探索。やり直し回数は都市数が分かってから、個体数は -m ga のときだけ決める
+  // スレッド数の既定値はCPUのコア数、seedの既定値は時刻
+  // 制限時間を付けると、やり直しはその時間で打ち切り、焼きなましはその時間をかけて温度を下げる。
+  // 連鎖LKはその時間までキックを続け、GAはその時間を過ぎた世代で止める (焼きなまし・連鎖LKの最初の局所探索も時間に数える)
+  Config conf = {.ls = LS_OROPT, .k = 8, .restarts = -1, .dist = DC_AUTO,
+                 .threads = (int)sysconf(_SC_NPROCESSORS_ONLN), .seed = (unsigned int)time(NULL),
+                 .method = MT_RESTART, .time_limit = 0, .index = IX_AUTO, .init = INIT_IDENTITY,
+                 .population = 0};
+  int opt;
+  while ((opt = getopt(argc, argv, "m:p:l:k:r:T:d:g:i:t:s:")) != -1){
+    switch (opt){
+    case 'm':
+      if (strcmp(optarg, "restart") == 0) conf.method = MT_RESTART;
+      else if (strcmp(optarg, "sa") == 0) conf.method = MT_SA;
+      else if (strcmp(optarg, "lk") == 0) conf.method = MT_LK;
+      else if (strcmp(optarg, "ga") == 0) conf.method = MT_GA;
+      else {
+        fprintf(stderr, "%s: unknown method.\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'p':
+      conf.population = load_int(optarg);
+      assert( conf.population > 1 );
+      break;
+    case 'T':
+      conf.time_limit = load_double(optarg);
+      assert( conf.time_limit > 0 );
+      break;
+    case 'l':
+      if (strcmp(optarg, "yama") == 0) conf.ls = LS_YAMA;
+      else if (strcmp(optarg, "2opt") == 0) conf.ls = LS_2OPT;
+      else if (strcmp(optarg, "oropt") == 0) conf.ls = LS_OROPT;
+      else if (strcmp(optarg, "lk") == 0) conf.ls = LS_LK;
+      else {
+        fprintf(stderr, "%s: unknown local search.\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'k':
+      conf.k = load_int(optarg);
+      assert( conf.k > 0 );
+      break;
+    case 'r':
+      conf.restarts = load_int(optarg);
+      assert( conf.restarts > 0 );
+      break;
+    case 'd':
+      if (strcmp(optarg, "auto") == 0) conf.dist = DC_AUTO;
+      else if (strcmp(optarg, "none") == 0) conf.dist = DC_NONE;
+      else if (strcmp(optarg, "double") == 0) conf.dist = DC_DOUBLE;
+      else if (strcmp(optarg, "float") == 0) conf.dist = DC_FLOAT;
+      else if (strcmp(optarg, "int") == 0) conf.dist = DC_INT;
+      else if (strcmp(optarg, "cache") == 0) conf.dist = DC_CACHE;
+      else {
+        fprintf(stderr, "%s: unknown distance cache.\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'g':
+      if (strcmp(optarg, "auto") == 0) conf.index = IX_AUTO;
+      else if (strcmp(optarg, "grid") == 0) conf.index = IX_GRID;
+      else if (strcmp(optarg, "kdtree") == 0) conf.index = IX_KDTREE;
+      else {
+        fprintf(stderr, "%s: unknown spatial index.\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'i':
+      if (strcmp(optarg, "identity") == 0) conf.init = INIT_IDENTITY;
+      else if (strcmp(optarg, "nn") == 0) conf.init = INIT_NN;
+      else if (strcmp(optarg, "greedy") == 0) conf.init = INIT_GREEDY;
+      else if (strcmp(optarg, "hilbert") == 0) conf.init = INIT_HILBERT;
+      else if (strcmp(optarg, "christofides") == 0) conf.init = INIT_CHRISTOFIDES;
+      else {
+        fprintf(stderr, "%s: unknown initial tour.\n", optarg);
+        exit(1);
+      }
+      break;
+    case 't':
+      conf.threads = load_int(optarg);
+      assert( conf.threads > 0 );
+      break;
+    case 's':
+      conf.seed = (unsigned int)load_int(optarg);
+      break;
+    default:
+      fprintf(stderr, usage, argv[0]);
+      exit(1);
+    }
+  }
+  if (argc - optind != 1){
+    fprintf(stderr, usage, argv[0]);
+    exit(1);
+  }
+  // 使わない方法に付けても黙って無視されないように止める
+  if (conf.population > 0 && conf.method != MT_GA){
+    fprintf(stderr, "-p %d: only -m ga has a population.\n", conf.population);
     exit(1);
   }
+  if (conf.restarts > 0 && conf.method != MT_RESTART){
+    fprintf(stderr, "-r %d: only -m restart restarts.\n", conf.restarts);
+    exit(1);
+  }
+  if (conf.population == 0) conf.population = 32;
   int n;
-  
-
-  City *city = load_cities(argv[1],&n);
-  assert( n > 1 && n <= max_cities); // さすがに都市数100は厳しいので
+  MappedFile file;
+  const City *city = load_cities(argv[optind],&n,&file);
+  assert( n > 1 ); // 差分評価にしたので都市数の上限は外した
+  // 地図に収まらない大きな入力は描画しない
+  const int drawable = fits_map(map, city, n);
   // 町の初期配置を表示
-  plot_cities(fp, map, city, n, NULL);
+  if (drawable) plot_cities(fp, map, city, n, NULL);
 
   // 訪れる順序を記録する配列を設定
   int *route = (int*)calloc(n, sizeof(int));
 
-  const double d = solve(city,n,route);
-  plot_cities(fp, map, city, n, route);
+  // yamaは局所最適が悪いので回数で補う。近傍リスト版は少ない回数で十分
+  if (conf.restarts < 0) conf.restarts = (conf.ls == LS_YAMA) ? 10 * n : 10;
+  if (conf.threads < 1) conf.threads = 1;
+  fprintf(stderr, "seed = %u, threads = %d\n", conf.seed, conf.threads);
+  init_dist_cache(city, n, conf.dist, conf.threads);
+  solve(city,n,route,&conf);
+  free_dist_cache();
+  // float や整数のキャッシュでは誤差があるので、表示する距離は正確に計算し直す
+  const double d = tour_length(city,n,route);
+  if (drawable) plot_cities(fp, map, city, n, route);
   printf("total distance = %f\n", d);
   for (int i = 0 ; i < n ; i++){
     printf("%d -> ", route[i]);
@@ -111,7 +469,7 @@ int main(int argc, char**argv)
 
   // 動的確保した環境ではfreeをする
   free(route);
-  free(city);
+  unmap_file(&file);
   
   return 0;
 }
@@ -127,7 +485,7 @@ void draw_line(Map map, City a, City b)
   }
 }
 
-void draw_route(Map map, City *city, int n, const int *route)
+void draw_route(Map map, const City *city, int n, const int *route)
 {
   if (route == NULL) return;
 
@@ -138,7 +496,7 @@ void draw_route(Map map, City *city, int n, const int *route)
   }
 }
 
-void plot_cities(FILE *fp, Map map, City *city, int n, const int *route)
+void plot_cities(FILE *fp, Map map, const City *city, int n, const int *route)
 {
   fprintf(fp, "----------\n");
 
@@ -174,93 +532,1742 @@ double distance(City a, City b)
   return sqrt(dx * dx + dy * dy);
 }
 
-double solve(const City *city, int n, int *best_route)
+// 密行列に必要なバイト数 (1行を64バイトの倍数に切り上げる)
+static size_t matrix_bytes(int n, size_t elem, size_t *stride)
 {
-  best_route[0] = 0; // 循環した結果を避けるため、常に0番目からスタート
-  
-  int nowroute[n];
-  for (int i = 0 ; i < n ; i++){
-    best_route[i] = i;
-    nowroute[i]=best_route[i];
-  }//数字を順番通りに回った時のroute
+  *stride = ((n * elem + 63) / 64 * 64) / elem;
+  return *stride * elem * n;
+}
 
+void init_dist_cache(const City *city, int n, DistMode mode, int threads)
+{
+  size_t stride;
+  if (mode == DC_AUTO){
+    // 密行列が数十MBに収まる範囲では行列、それを超えたらハッシュ表にする
+    if (matrix_bytes(n, sizeof(double), &stride) <= ((size_t)64 << 20)) mode = DC_DOUBLE;
+    else if (matrix_bytes(n, sizeof(float), &stride) <= ((size_t)64 << 20)) mode = DC_FLOAT;
+    else mode = DC_CACHE;
+  }
+  dist_cache = (DistCache){.mode = mode};
+
+  size_t bytes = 0;
+  const char *name = "none (sqrt every time)";
+  if (mode == DC_DOUBLE || mode == DC_FLOAT || mode == DC_INT){
+    const size_t elem = (mode == DC_DOUBLE) ? sizeof(double) : (mode == DC_FLOAT) ? sizeof(float) : sizeof(int);
+    bytes = matrix_bytes(n, elem, &stride);
+    void *m = aligned_alloc(64, bytes);
+    if (m == NULL){
+      fprintf(stderr, "distance matrix: cannot allocate %zu bytes.\n", bytes);
+      exit(1);
+    }
+    for (int i = 0 ; i < n ; i++){
+      for (int j = 0 ; j < n ; j++){
+        const double d = distance(city[i], city[j]);
+        const size_t k = (size_t)i * stride + j;
+        if (mode == DC_DOUBLE) ((double*)m)[k] = d;
+        else if (mode == DC_FLOAT) ((float*)m)[k] = (float)d;
+        else ((int*)m)[k] = (int)(d + 0.5);
+      }
+    }
+    dist_cache.matrix = m;
+    dist_cache.stride = stride;
+    name = (mode == DC_DOUBLE) ? "double matrix" : (mode == DC_FLOAT) ? "float matrix" : "rounded int matrix";
+  } else if (mode == DC_CACHE){
+    // 都市数の数倍の組を覚えられる大きさ (2の冪, 最大 2^22 エントリ = 64MB)
+    size_t size = 1024;
+    while (size < (size_t)n * 16 && size < ((size_t)1 << 22)) size *= 2;
+    dist_cache.mask = size - 1;
+    // 表はスレッドごとなので、同時に持つ全スレッド分の大きさを表示する
+    fprintf(stderr, "distance cache: hash cache, %.1f MB per thread x %d threads = %.1f MB\n",
+            sizeof(DistEntry) * size / (1024.0 * 1024.0), threads,
+            sizeof(DistEntry) * size * (double)threads / (1024.0 * 1024.0));
+    return;
+  }
+  fprintf(stderr, "distance cache: %s, %.1f MB\n", name, bytes / (1024.0 * 1024.0));
+}
+
+void free_dist_cache(void)
+{
+  free(dist_cache.matrix);
+  free_dist_table();
+  dist_cache = (DistCache){.mode = DC_NONE};
+}
+
+void free_dist_table(void)
+{
+  free(dist_table);
+  dist_table = NULL;
+}
+
+// ハッシュ表から引く。なければ計算して上書きする
+static double cached_distance(const City *city, int a, int b)
+{
+  if (a > b){
+    const int x = a; a = b; b = x;
+  }
+  if (dist_table == NULL){
+    dist_table = (DistEntry*)malloc(sizeof(DistEntry) * (dist_cache.mask + 1));
+    for (size_t i = 0 ; i <= dist_cache.mask ; i++) dist_table[i] = (DistEntry){.d = 0, .a = -1, .b = -1};
+  }
+  const size_t h = ((unsigned)a * 0x9E3779B1u ^ (unsigned)b * 0x85EBCA77u) & dist_cache.mask;
+  DistEntry *e = &dist_table[h];
+  if (e->a != a || e->b != b){
+    *e = (DistEntry){.d = distance(city[a], city[b]), .a = a, .b = b};
+  }
+  return e->d;
+}
+
+static inline double dist(const City *city, int a, int b)
+{
+  const size_t k = (size_t)a * dist_cache.stride + b;
+  switch (dist_cache.mode){
+  case DC_DOUBLE: return ((const double*)dist_cache.matrix)[k];
+  case DC_FLOAT: return ((const float*)dist_cache.matrix)[k];
+  case DC_INT: return ((const int*)dist_cache.matrix)[k];
+  case DC_CACHE: return cached_distance(city, a, b);
+  default: return distance(city[a], city[b]);
+  }
+}
+
+// routeでの巡回距離の総和
+double tour_length(const City *city, int n, const int *route)
+{
   double sum_d = 0;
   for (int i = 0 ; i < n ; i++){
-    const int c0 = best_route[i];
-    const int c1 = best_route[(i+1)%n]; // i=0の時はc1は0になる。
-    sum_d += distance(city[c0],city[c1]);
-  }//ここで数字の順番通りに回った場合の距離を出して、それをbest_distanceの初期値にしている。
-  double best_distance=sum_d;
-  srand((unsigned int)time(NULL));//乱数のseedを作成
-
-
-  for(int k=0;k<10*n;k++){//山登りを（狭義）30*n回する
-      for(int shufle=0;shufle<3*n;shufle++){
-          int a=rand()%(n-1)+1;//1~(n-1)までの数
-          int b=rand()%(n-1)+1;//1~(n-1)までの数
+    const int c0 = route[i];
+    const int c1 = route[(i+1)%n]; // nは0に戻る
+    sum_d += dist(city, c0, c1);
+  }
+  return sum_d;
+}
+
+// 位置i,j (1 <= i < j <= n-1) の町を交換したときの距離の変化量
+// 影響を受けるのは両隣の辺(最大4本)だけなので、全体を計算し直す必要はない
+double swap_delta(const City *city, int n, const int *route, int i, int j)
+{
+  const int a = route[i-1], b = route[i], c = route[(i+1)%n];
+  const int d = route[j-1], e = route[j], f = route[(j+1)%n];
+  if (j == i + 1){
+    // 隣り合っている場合: a b e f -> a e b f
+    return dist(city, a, e) + dist(city, b, f)
+      - dist(city, a, b) - dist(city, e, f);
+  }
+  // 離れている場合: a b c ... d e f -> a e c ... d b f
+  // (i=1, j=n-1 で f=a となる場合も打ち消しあうのでこの式でよい)
+  return dist(city, a, e) + dist(city, e, c)
+    + dist(city, d, b) + dist(city, b, f)
+    - dist(city, a, b) - dist(city, b, c)
+    - dist(city, d, e) - dist(city, e, f);
+}
+
+// 辺(route[i],route[i+1])と辺(route[j],route[j+1])を切って
+// (route[i],route[j])と(route[i+1],route[j+1])に繋ぎ替えたときの距離の変化量 (0 <= i < j <= n-1)
+double two_opt_delta(const City *city, int n, const int *route, int i, int j)
+{
+  const int a = route[i], b = route[i+1];
+  const int c = route[j], d = route[(j+1)%n];
+  return dist(city, a, c) + dist(city, b, d)
+    - dist(city, a, b) - dist(city, c, d);
+}
+
+void apply_swap(int *route, int i, int j)
+{
+  const int x = route[i];
+  route[i] = route[j];
+  route[j] = x;
+}
+
+// 2-optの適用は route[i+1..j] の反転。i >= 0 なので0番目の町は動かない
+void apply_two_opt(int *route, int i, int j)
+{
+  for (int l = i + 1, r = j ; l < r ; l++, r--){
+    const int x = route[l];
+    route[l] = route[r];
+    route[r] = x;
+  }
+}
+
+Workspace init_workspace(int n)
+{
+  return (Workspace){
+    .nowroute = (int*)malloc(sizeof(int) * n),
+    .good_route = (int*)malloc(sizeof(int) * n),
+    .pos = (int*)malloc(sizeof(int) * n),
+    .queue = (int*)malloc(sizeof(int) * n),
+    .queued = (char*)malloc(sizeof(char) * n),
+  };
+}
+
+void free_workspace(Workspace *w)
+{
+  free(w->nowroute);
+  free(w->good_route);
+  free(w->pos);
+  free(w->queue);
+  free(w->queued);
+}
+
+// xorshift64* 。seedとストリーム番号からsplitmix64で初期状態を作るので、
+// スレッドごとに重ならない乱数列になる
+Rng rng_init(uint64_t seed, uint64_t stream)
+{
+  uint64_t z = seed + 0x9E3779B97F4A7C15ull * (stream + 1);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  z ^= z >> 31;
+  return (Rng){.s = z ? z : 1};
+}
+
+uint64_t rng_next(Rng *r)
+{
+  r->s ^= r->s >> 12;
+  r->s ^= r->s << 25;
+  r->s ^= r->s >> 27;
+  return r->s * 0x2545F4914F6CDD1Dull;
+}
+
+// 0以上m未満の整数
+int rng_int(Rng *r, int m)
+{
+  return (int)((rng_next(r) >> 32) * (uint64_t)m >> 32);
+}
+
+double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 1スレッド分の山登り。restartsのうち k = id, id+threads, ... 番目を担当する。
+// 作業領域も最良経路もスレッドごとに持つので、実行中に他のスレッドと共有するものはない
+typedef struct
+{
+  const City *city;
+  int n;
+  const Config *conf;
+  const NeighborList *nl;
+  int id;
+  double deadline; // now_sec() がこの値を超えたら打ち切る。0なら制限なし
+  int *best_route; // このスレッドで一番短かった経路
+  double best;     // その距離
+} Worker;
+
+static void *restart_worker(void *arg)
+{
+  Worker *wk = (Worker*)arg;
+  const City *city = wk->city;
+  const int n = wk->n;
+  const Config *conf = wk->conf;
+  Rng rng = rng_init(conf->seed, wk->id);
+
+  Workspace w = init_workspace(n);
+  int *nowroute = w.nowroute;
+  int *good_route = w.good_route;
+  for (int i = 0 ; i < n ; i++){
+    nowroute[i] = wk->best_route[i];
+  }
+
+  for(int k=wk->id;k<conf->restarts;k+=conf->threads){
+      // 制限時間を過ぎたら打ち切る (各スレッド最低1回はやる)
+      if (wk->deadline > 0 && k > wk->id && now_sec() >= wk->deadline) break;
+      // 構築法で作った経路は、最初の1回だけシャッフルせずにそのまま登る
+      for(int shufle=0;shufle<3*n && !(k==0 && conf->init!=INIT_IDENTITY);shufle++){
+          int a=rng_int(&rng,n-1)+1;//1~(n-1)までの数
+          int b=rng_int(&rng,n-1)+1;//1~(n-1)までの数
           int x=nowroute[a];
           nowroute[a]=nowroute[b];
           nowroute[b]=x;//0以外の二つの数を交換
       }//nowrouteをシャッフルする
-      int good_route[n];
-      for(int i=0;i<n;i++){
-        good_route[i]=nowroute[i];
+      double sumd;
+      if (conf->ls == LS_YAMA){
+        // yamaはnowrouteをそのまま登り、次のシャッフルは登った後の経路から始める
+        sumd = yama(city,n,nowroute);
+        memcpy(good_route, nowroute, sizeof(int) * n);
+      } else {
+        memcpy(good_route, nowroute, sizeof(int) * n);
+        sumd = local_search(city,n,good_route,wk->nl,&w,conf->ls,0);
       }
-      double sumd = 0;
-      for (int i = 0 ; i < n ; i++){
-          const int c0 = good_route[i];
-          const int c1 = good_route[(i+1)%n]; //i=0の時はc1は0になる。
-          sumd += distance(city[c0],city[c1]);
+      // 複数スレッドの出力が行の途中で混ざらないようにまとめて書く
+      flockfile(stdout);
+      if (conf->ls == LS_YAMA){
+        printf("%f ",sumd);
+        for(int i=0;i<n;i++) printf("%d ",good_route[i]);
+        printf("\n");
+      } else {
+        printf("restart %d: %f\n", k, sumd);
       }
-      yama(city,n,good_route,nowroute,&sumd);
-      if(sumd<best_distance){
-          best_distance = sumd;
-          for(int i=0;i<n;i++){
-            best_route[i]=good_route[i];
-          }
+      funlockfile(stdout);
+      if(sumd<wk->best){
+          wk->best = sumd;
+          memcpy(wk->best_route, good_route, sizeof(int) * n);
       }
   }
+
+  free_workspace(&w);
+  free_dist_table();
+  return NULL;
+}
+
+// 焼きなましと連鎖LKは1スレッドに1回。スレッドごとに別の乱数列で、同じ初期経路から始める
+static void *single_run_worker(void *arg)
+{
+  Worker *wk = (Worker*)arg;
+  const int n = wk->n;
+  Rng rng = rng_init(wk->conf->seed, wk->id);
+  Workspace w = init_workspace(n);
+  memcpy(w.nowroute, wk->best_route, sizeof(int) * n);
+  const int sa = (wk->conf->method == MT_SA);
+  const double sumd = sa ? anneal(wk->city, n, w.nowroute, wk->nl, &w, &rng, wk->deadline)
+    : chained_lk(wk->city, n, w.nowroute, wk->nl, &w, &rng, wk->deadline);
+  flockfile(stdout);
+  printf("%s %d: %f\n", sa ? "anneal" : "lk", wk->id, sumd);
+  funlockfile(stdout);
+  if (sumd < wk->best){
+    wk->best = sumd;
+    memcpy(wk->best_route, w.nowroute, sizeof(int) * n);
+  }
+  free_workspace(&w);
+  free_dist_table();
+  return NULL;
+}
+
+// 最初の経路 (-i) を作り、conf->method の方法で改善して一番短い経路を best_route に入れる。
+//  restart: 山登りのやり直しを conf->threads 個のスレッドに分ける (restart_worker)
+//  sa, lk: 焼きなまし・連鎖LKを各スレッドで1回ずつ、別の乱数列で走らせる (single_run_worker)
+//  ga: genetic に任せて返る (子の生成を世代ごとにスレッドに分ける)
+// restart, sa, lk では各スレッドは自分の最良経路だけを更新し、全スレッドが終わった後に
+// スレッド番号順に比べて一番短いものを選ぶ (ロックは使わない)。
+// どの方法でも乱数列は (seed, スレッド番号) だけで決まるので、seedとスレッド数が同じなら結果も同じになる
+// (制限時間を付けたときは、打ち切るまでに進んだ量で結果が変わる)
+double solve(const City *city, int n, int *best_route, const Config *conf)
+{
+  const double deadline = (conf->time_limit > 0) ? now_sec() + conf->time_limit : 0;
+  best_route[0] = 0; // 循環した結果を避けるため、常に0番目からスタート
+  for (int i = 0 ; i < n ; i++){
+    best_route[i] = i;
+  }//数字を順番通りに回った時のroute
+  if (conf->init != INIT_IDENTITY){
+    const double t0 = now_sec();
+    construct_tour(city, n, conf->init, conf->index, best_route);
+    fprintf(stderr, "initial tour: %f (%.3f s)\n", tour_length(city, n, best_route), now_sec() - t0);
+  }
+
+  //ここで最初の経路の距離を出して、それをbest_distanceの初期値にしている。
+  double best_distance=tour_length(city,n,best_route);
+
+  // 近傍リスト版の局所探索の準備 (yamaのやり直しでは使わない)
+  NeighborList nl = {.k = 0, .list = NULL};
+  if (conf->ls != LS_YAMA || conf->method != MT_RESTART){
+    SpatialIndex ix = build_index(city, n, conf->index);
+    describe_index(&ix);
+    nl = build_neighbors(&ix, conf->k);
+    free_index(&ix);
+  }
+  if (conf->method == MT_GA){
+    best_distance = genetic(city, n, best_route, &nl, conf, deadline);
+    free(nl.list);
+    return best_distance;
+  }
+  if (conf->method == MT_SA) init_accept_table();
+  // 焼きなましと連鎖LKの最初の局所探索はどのスレッドでも同じなので、ここで1回だけして局所最適を渡す
+  // (制限時間に数え、過ぎたらそこで止める)
+  if (conf->method == MT_SA || conf->method == MT_LK){
+    const double t0 = now_sec();
+    Workspace w = init_workspace(n);
+    const LocalSearch ls = (conf->method == MT_SA) ? LS_OROPT : LS_LK;
+    best_distance = local_search(city, n, best_route, &nl, &w, ls, deadline);
+    free_workspace(&w);
+    fprintf(stderr, "first descent: %f (%.3f s)\n", best_distance, now_sec() - t0);
+  }
+  free_dist_table(); // ここまでに作ったこのスレッドのハッシュ表。同時に持つのはワーカーの threads 個だけにする
+  void *(*worker)(void*) = (conf->method == MT_RESTART) ? restart_worker : single_run_worker;
+
+  const int T = conf->threads;
+  Worker *wk = (Worker*)malloc(sizeof(Worker) * T);
+  pthread_t *th = (pthread_t*)malloc(sizeof(pthread_t) * T);
+  for (int t = 0 ; t < T ; t++){
+    wk[t] = (Worker){.city = city, .n = n, .conf = conf, .nl = &nl, .id = t, .deadline = deadline,
+                     .best_route = (int*)malloc(sizeof(int) * n), .best = best_distance};
+    memcpy(wk[t].best_route, best_route, sizeof(int) * n);
+  }
+  if (T == 1){
+    worker(&wk[0]);
+  } else {
+    for (int t = 0 ; t < T ; t++){
+      if (pthread_create(&th[t], NULL, worker, &wk[t]) != 0){
+        fprintf(stderr, "cannot create thread %d.\n", t);
+        exit(1);
+      }
+    }
+    for (int t = 0 ; t < T ; t++) pthread_join(th[t], NULL);
+  }
+
+  for (int t = 0 ; t < T ; t++){
+    if (wk[t].best < best_distance){
+      best_distance = wk[t].best;
+      memcpy(best_route, wk[t].best_route, sizeof(int) * n);
+    }
+    free(wk[t].best_route);
+  }
+  free(wk);
+  free(th);
+  free(nl.list);
   return best_distance;
 }
 
-void yama(const City *city, int n, int *good_route, int *nowroute,double *min){
-  short flag=0;//一回のステップの中で改善策が見つかったかどうか。
-  for(int i=1;i<n-1;i++){
-      for(int j=i+1;j<n;j++){//0以外の町から二つ町を交換させ、それで改善されたらgood_routeとする。
-          double newdis=0;
-          int tmp_route[n];
-          for (int make_tmp_route=0;make_tmp_route<n;make_tmp_route++){
-            tmp_route[make_tmp_route]=nowroute[make_tmp_route];
-          }
-          tmp_route[j]=nowroute[i];
-          tmp_route[i]=nowroute[j];//nowrouteからi番目とj番目を交換したtmp_routeを作る。
-          for (int k = 0 ; k < n ; k++){
-            const int c0 = tmp_route[k];
-            const int c1 = tmp_route[(k+1)%n]; 
-            newdis += distance(city[c0],city[c1]);
-          }//新しい距離を計算
-          if(newdis<*min){
-              flag=1;
-              *min=newdis;
-              for(int k=0;k<n;k++){
-                  good_route[k]=tmp_route[k];
+// 1回のステップで「0以外の2つの町の交換」と「2-opt」の全ての候補を差分で評価し、
+// 最も改善する移動をrouteにその場で適用する。1ステップはO(n^2)
+// 改善がなくなるまでステップを繰り返し(再帰はしない)、局所最適の距離を返す
+double yama(const City *city, int n, int *route){
+  for(;;){
+    double best_delta = -1e-9; // 浮動小数点の誤差で無限に改善し続けないように少しだけ負にする
+    int best_i = -1, best_j = -1;
+    short best_kind = 0; // 0:改善なし 1:交換 2:2-opt
+
+    for(int i=1;i<n-1;i++){
+        for(int j=i+1;j<n;j++){
+            const double d = swap_delta(city,n,route,i,j);
+            if(d<best_delta){
+                best_delta=d; best_i=i; best_j=j; best_kind=1;
+            }
+        }
+    }
+    for(int i=0;i<n-2;i++){
+        for(int j=i+2;j<n;j++){
+            if(i==0&&j==n-1) continue; // 同じ頂点を共有する辺同士なので意味がない
+            const double d = two_opt_delta(city,n,route,i,j);
+            if(d<best_delta){
+                best_delta=d; best_i=i; best_j=j; best_kind=2;
+            }
+        }
+    }
+
+    if(best_kind==0) break; // これ以上改善できないので局所最適
+    if(best_kind==1) apply_swap(route,best_i,best_j);
+    else apply_two_opt(route,best_i,best_j);
+  }
+
+  return tour_length(city,n,route);
+}
+
+
+// 各町について近い順にk個の町を選ぶ。空間索引のk近傍探索を町ごとにするので、一様な配置ならほぼO(n k)
+// (以前は全ての組を調べてO(n^2 k)だった。距離が同じなら番号の小さい町を先にするので、並びは以前と同じ)
+NeighborList build_neighbors(const SpatialIndex *ix, int k)
+{
+  const int n = ix->n;
+  if (k > n - 1) k = n - 1;
+  int *list = (int*)malloc(sizeof(int) * n * k);
+  double *d2 = (double*)malloc(sizeof(double) * k);
+  for (int i = 0 ; i < n ; i++){
+    index_knn(ix, i, k, list + (size_t)i * k, d2);
+  }
+  free(d2);
+  return (NeighborList){.k = k, .list = list};
+}
+
+// k-d木の葉に入れる町の数の上限
+#define KD_LEAF 8
+
+static inline int coord(City c, int dim)
+{
+  return dim ? c.y : c.x;
+}
+
+static inline double dist2(City a, City b)
+{
+  const double dx = (double)a.x - b.x;
+  const double dy = (double)a.y - b.y;
+  return dx * dx + dy * dy;
+}
+
+// 近い順k個の候補に町jを入れる (挿入ソート)。距離の2乗が同じなら番号の小さい方を先にする
+static inline void knn_insert(int *out, double *d2, int *m, int k, int j, double dj)
+{
+  if (*m == k && (dj > d2[k-1] || (dj == d2[k-1] && j > out[k-1]))) return;
+  int p = (*m < k) ? (*m)++ : k - 1;
+  while (p > 0 && (d2[p-1] > dj || (d2[p-1] == dj && out[p-1] > j))){
+    d2[p] = d2[p-1];
+    out[p] = out[p-1];
+    p--;
+  }
+  d2[p] = dj;
+  out[p] = j;
+}
+
+// perm[lo..hi) を並べ替えて、dim の座標で kth 番目の町を perm[kth] に置く (左は以下、右は以上)
+// 同じ座標が多くても遅くならないように、ピボットと等しいものを真ん中に集める3分割にする
+static void kd_select(const City *city, int *perm, int lo, int hi, int kth, int dim)
+{
+  while (hi - lo > 1){
+    const int pivot = coord(city[perm[lo + (hi - lo) / 2]], dim);
+    int lt = lo, i = lo, gt = hi;
+    while (i < gt){
+      const int v = coord(city[perm[i]], dim);
+      if (v < pivot){
+        const int x = perm[lt]; perm[lt++] = perm[i]; perm[i++] = x;
+      } else if (v > pivot){
+        const int x = perm[--gt]; perm[gt] = perm[i]; perm[i] = x;
+      } else i++;
+    }
+    if (kth < lt) hi = lt;
+    else if (kth >= gt) lo = gt;
+    else return;
+  }
+}
+
+// perm[lo..hi) の節を作って番号を返す。町の広がりが大きい方の軸の中央値で分ける
+static int kd_build(SpatialIndex *ix, int *nnode, int lo, int hi, int parent)
+{
+  const int id = (*nnode)++;
+  KdNode *t = &ix->node[id];
+  *t = (KdNode){.lo = lo, .hi = hi, .left = -1, .right = -1, .parent = parent, .dim = 0, .split = 0, .alive = hi - lo};
+  if (hi - lo <= KD_LEAF){
+    for (int i = lo ; i < hi ; i++) ix->leaf[ix->perm[i]] = id;
+    return id;
+  }
+  int minx = INT_MAX, maxx = INT_MIN, miny = INT_MAX, maxy = INT_MIN;
+  for (int i = lo ; i < hi ; i++){
+    const City c = ix->city[ix->perm[i]];
+    if (c.x < minx) minx = c.x;
+    if (c.x > maxx) maxx = c.x;
+    if (c.y < miny) miny = c.y;
+    if (c.y > maxy) maxy = c.y;
+  }
+  const int dim = ((double)maxy - miny > (double)maxx - minx);
+  const int mid = lo + (hi - lo) / 2;
+  kd_select(ix->city, ix->perm, lo, hi, mid, dim);
+  t->dim = dim;
+  t->split = coord(ix->city[ix->perm[mid]], dim);
+  // 子を作ると ix->node[id] の中身が書き換わるので、t を通さずに書く
+  const int left = kd_build(ix, nnode, lo, mid, id);
+  const int right = kd_build(ix, nnode, mid, hi, id);
+  ix->node[id].left = left;
+  ix->node[id].right = right;
+  return id;
+}
+
+// 格子を作る。1つの升目に平均2町くらい入る大きさにする
+// (升目の数は町の数の2倍まで。横長や縦長の配置でも升目が増えすぎないようにする)
+static void grid_build(SpatialIndex *ix)
+{
+  const City *city = ix->city;
+  const int n = ix->n;
+  int minx = INT_MAX, maxx = INT_MIN, miny = INT_MAX, maxy = INT_MIN;
+  for (int i = 0 ; i < n ; i++){
+    if (city[i].x < minx) minx = city[i].x;
+    if (city[i].x > maxx) maxx = city[i].x;
+    if (city[i].y < miny) miny = city[i].y;
+    if (city[i].y > maxy) maxy = city[i].y;
+  }
+  const double w = (double)maxx - minx + 1, h = (double)maxy - miny + 1;
+  double cell = ceil(sqrt(w * h / (n / 2.0 + 1)));
+  if (cell < 1) cell = 1;
+  while (ceil(w / cell) * ceil(h / cell) > 2.0 * n + 1) cell *= 2;
+  ix->minx = minx;
+  ix->miny = miny;
+  ix->cell = (int)cell;
+  ix->gx = (int)ceil(w / cell);
+  ix->gy = (int)ceil(h / cell);
+
+  const size_t cells = (size_t)ix->gx * ix->gy;
+  ix->start = (int*)calloc(cells + 1, sizeof(int));
+  ix->count = (int*)calloc(cells, sizeof(int));
+  ix->items = (int*)malloc(sizeof(int) * n);
+  ix->slot = (int*)malloc(sizeof(int) * n);
+  // 升目ごとの数を数えてから、升目の順に町を並べる (番号順なので升目の中も番号順になる)
+  for (int i = 0 ; i < n ; i++){
+    ix->count[(size_t)((city[i].y - miny) / ix->cell) * ix->gx + (city[i].x - minx) / ix->cell]++;
+  }
+  for (size_t g = 0 ; g < cells ; g++) ix->start[g+1] = ix->start[g] + ix->count[g];
+  memset(ix->count, 0, sizeof(int) * cells);
+  for (int i = 0 ; i < n ; i++){
+    const size_t g = (size_t)((city[i].y - miny) / ix->cell) * ix->gx + (city[i].x - minx) / ix->cell;
+    ix->slot[i] = ix->start[g] + ix->count[g]++;
+    ix->items[ix->slot[i]] = i;
+  }
+}
+
+// 空間索引を作る。IX_AUTO のときはまず格子を作り、町のいる升目が全体の半分もなければ
+// (一様な配置なら約86%) 偏った配置なのでk-d木に作り直す
+SpatialIndex build_index(const City *city, int n, IndexKind kind)
+{
+  SpatialIndex ix = {.kind = kind, .city = city, .n = n};
+  ix.removed = (char*)calloc(n, sizeof(char));
+  if (kind != IX_KDTREE){
+    grid_build(&ix);
+    size_t occupied = 0;
+    const size_t cells = (size_t)ix.gx * ix.gy;
+    for (size_t g = 0 ; g < cells ; g++) occupied += (ix.count[g] > 0);
+    ix.kind = IX_GRID;
+    if (kind == IX_AUTO && occupied * 2 < cells){
+      free(ix.start); free(ix.count); free(ix.items); free(ix.slot);
+      ix.start = ix.count = ix.items = ix.slot = NULL;
+      ix.kind = IX_KDTREE;
+    }
+  }
+  if (ix.kind == IX_KDTREE){
+    // 葉は KD_LEAF 個以下、節は葉の数の2倍未満なので 2n 個あれば足りる
+    ix.node = (KdNode*)malloc(sizeof(KdNode) * 2 * (size_t)n);
+    ix.perm = (int*)malloc(sizeof(int) * n);
+    ix.leaf = (int*)malloc(sizeof(int) * n);
+    for (int i = 0 ; i < n ; i++) ix.perm[i] = i;
+    kd_build(&ix, &ix.nnode, 0, n, -1);
+  }
+  return ix;
+}
+
+void describe_index(const SpatialIndex *ix)
+{
+  if (ix->kind == IX_GRID) fprintf(stderr, "spatial index: grid %d x %d, cell %d\n", ix->gx, ix->gy, ix->cell);
+  else fprintf(stderr, "spatial index: k-d tree, %d nodes\n", ix->nnode);
+}
+
+void free_index(SpatialIndex *ix)
+{
+  free(ix->removed);
+  free(ix->start);
+  free(ix->count);
+  free(ix->items);
+  free(ix->slot);
+  free(ix->node);
+  free(ix->perm);
+  free(ix->leaf);
+}
+
+// k-d木で q に近い順k個を探す。近い側の子から調べ、分割面までの距離が今のk番目より遠ければ反対側は調べない
+static void kd_knn(const SpatialIndex *ix, int id, City q, int self, int k, int *out, double *d2, int *m)
+{
+  const KdNode *t = &ix->node[id];
+  if (t->alive == 0) return;
+  if (t->left < 0){
+    for (int i = t->lo ; i < t->hi ; i++){
+      const int j = ix->perm[i];
+      if (j != self && !ix->removed[j]) knn_insert(out, d2, m, k, j, dist2(q, ix->city[j]));
+    }
+    return;
+  }
+  const double diff = (double)coord(q, t->dim) - t->split;
+  kd_knn(ix, (diff <= 0) ? t->left : t->right, q, self, k, out, d2, m);
+  // 同じ距離で番号の小さい町があるかもしれないので、等しいときも調べる
+  if (*m < k || diff * diff <= d2[k-1]) kd_knn(ix, (diff <= 0) ? t->right : t->left, q, self, k, out, d2, m);
+}
+
+// 格子の升目(x, y)の町を候補に入れる
+static void grid_cell_knn(const SpatialIndex *ix, int x, int y, City q, int self, int k, int *out, double *d2, int *m)
+{
+  if (x < 0 || x >= ix->gx || y < 0 || y >= ix->gy) return;
+  const size_t g = (size_t)y * ix->gx + x;
+  for (int i = ix->start[g] ; i < ix->start[g] + ix->count[g] ; i++){
+    const int j = ix->items[i];
+    if (j != self) knn_insert(out, d2, m, k, j, dist2(q, ix->city[j]));
+  }
+}
+
+// 町cに近い順にk個の町を out に入れ、見つかった数を返す (町が足りなければkより少ない)
+// d2 はk個分の作業領域で、終わったときには距離の2乗が入っている
+// 格子では、cの升目から1周ずつ外側の升目を調べる。r周目まで調べたとき、まだ調べていない町は
+// r x 升目の1辺 より遠いので、k番目がそれより近ければ終わる
+int index_knn(const SpatialIndex *ix, int c, int k, int *out, double *d2)
+{
+  const City q = ix->city[c];
+  int m = 0;
+  if (k <= 0) return 0;
+  if (ix->kind == IX_KDTREE){
+    kd_knn(ix, 0, q, c, k, out, d2, &m);
+    return m;
+  }
+  const int cx = (q.x - ix->minx) / ix->cell, cy = (q.y - ix->miny) / ix->cell;
+  const int rmax = max(max(cx, ix->gx - 1 - cx), max(cy, ix->gy - 1 - cy));
+  for (int r = 0 ; r <= rmax ; r++){
+    if (r == 0){
+      grid_cell_knn(ix, cx, cy, q, c, k, out, d2, &m);
+    } else {
+      for (int x = cx - r ; x <= cx + r ; x++){
+        grid_cell_knn(ix, x, cy - r, q, c, k, out, d2, &m);
+        grid_cell_knn(ix, x, cy + r, q, c, k, out, d2, &m);
+      }
+      for (int y = cy - r + 1 ; y <= cy + r - 1 ; y++){
+        grid_cell_knn(ix, cx - r, y, q, c, k, out, d2, &m);
+        grid_cell_knn(ix, cx + r, y, q, c, k, out, d2, &m);
+      }
+    }
+    const double reach = (double)r * ix->cell;
+    if (m == k && d2[k-1] < reach * reach) break;
+  }
+  return m;
+}
+
+int index_nearest(const SpatialIndex *ix, int c)
+{
+  int j;
+  double d2;
+  return (index_knn(ix, c, 1, &j, &d2) == 1) ? j : -1;
+}
+
+// 格子では升目の中の最後の町と場所を入れ替えて数を減らす。k-d木では葉から根までの数を減らす
+void index_remove(SpatialIndex *ix, int c)
+{
+  if (ix->removed[c]) return;
+  ix->removed[c] = 1;
+  if (ix->kind == IX_KDTREE){
+    for (int id = ix->leaf[c] ; id >= 0 ; id = ix->node[id].parent) ix->node[id].alive--;
+    return;
+  }
+  const City q = ix->city[c];
+  const size_t g = (size_t)((q.y - ix->miny) / ix->cell) * ix->gx + (q.x - ix->minx) / ix->cell;
+  const int last = ix->start[g] + --ix->count[g];
+  const int other = ix->items[last];
+  ix->items[ix->slot[c]] = other;
+  ix->slot[other] = ix->slot[c];
+  ix->items[last] = c;
+  ix->slot[c] = last;
+}
+
+// 連鎖LKでキックを取り消すための reverse_range の記録 (スレッドごと。NULLなら記録しない)
+// 経路の変更はすべて reverse_range でしているので、記録を逆順にもう1度反転すれば元に戻る
+typedef struct
+{
+  int *rec; // (位置, 個数) の組
+  size_t len;
+  size_t cap;
+} Journal;
+static _Thread_local Journal *journal = NULL;
+
+// 位置iから順にlen個の町を逆順にする (位置はnで循環する)
+static void reverse_range(int *route, int *pos, int n, int i, int len)
+{
+  if (journal != NULL){
+    if (journal->len + 2 > journal->cap){
+      journal->cap = (journal->cap == 0) ? 256 : journal->cap * 2;
+      journal->rec = (int*)realloc(journal->rec, sizeof(int) * journal->cap);
+    }
+    journal->rec[journal->len++] = i % n;
+    journal->rec[journal->len++] = len;
+  }
+  int l = i % n, r = (i + len - 1) % n;
+  for (int t = 0 ; t < len / 2 ; t++){
+    const int a = route[l], b = route[r];
+    route[l] = b; pos[b] = l;
+    route[r] = a; pos[a] = r;
+    l = (l + 1) % n;
+    r = (r + n - 1) % n;
+  }
+}
+
+// 2-opt: 辺(a, next a)と辺(c, next c)を(a,c)と(next a, next c)に繋ぎ替える
+// 内側と外側のどちらを反転しても同じ巡回路になるので、短い方を反転する
+static void two_opt_move(int *route, int *pos, int n, int a, int c)
+{
+  const int inner = (pos[c] - pos[a] + n) % n; // next a から c までの個数
+  if (inner <= n - inner) reverse_range(route, pos, n, pos[a] + 1, inner);
+  else reverse_range(route, pos, n, pos[c] + 1, n - inner);
+}
+
+// Or-opt: 位置sから始まる長さLの区間を辺(u, next u)の間に移す
+// reversed が1なら区間の向きを逆にして入れる。
+// 区間を前に送るか後ろに送るかで動かす量が変わるので、短い方を選ぶ
+static void or_opt_move(int *route, int *pos, int n, int s, int L, int u, int reversed)
+{
+  const int v = route[(pos[u] + 1) % n];
+  const int fwd = (pos[u] - (s + L) % n + n) % n + 1; // 区間の後ろからuまでの個数
+  const int bwd = (s - pos[v] + n) % n;               // vから区間の前までの個数
+  if (fwd <= bwd){
+    // s [区間] [X] v -> [X] [区間] v
+    reverse_range(route, pos, n, s, L + fwd);
+    reverse_range(route, pos, n, s, fwd);
+    if (!reversed) reverse_range(route, pos, n, s + fwd, L);
+  } else {
+    // u [Y] [区間] -> u [区間] [Y]
+    const int t = (s - bwd + n) % n;
+    reverse_range(route, pos, n, t, bwd + L);
+    reverse_range(route, pos, n, t + L, bwd);
+    if (!reversed) reverse_range(route, pos, n, t, L);
+  }
+}
+
+// don't-look bit を外して待ち行列に入れ直す
+static void push_city(Workspace *w, int n, int *tail, int *count, int c)
+{
+  if (w->queued[c]) return;
+  w->queued[c] = 1;
+  w->queue[*tail] = c;
+  *tail = (*tail + 1) % n;
+  (*count)++;
+}
+
+// 1回のLKの手で続ける2-optの数の上限と、1段目で試すt3の数
+#define LK_DEPTH 10
+#define LK_BREADTH 5
+
+// 辺(t1,t2)と辺(t3,t4)を外して(t2,t3)と(t4,t1)を繋ぐ
+// t2はt1の隣、t4はt3の隣で、t2がt1の後ろならt4はt3の前 (逆なら後ろ) のとき1つの巡回路になる
+static void lk_flip(int *route, int *pos, int n, int t1, int t2, int t3, int t4)
+{
+  if (route[(pos[t1] + 1) % n] == t2) two_opt_move(route, pos, n, t1, t4);
+  else two_opt_move(route, pos, n, t2, t3);
+}
+
+// t1から始めるLin-Kernighan風の手。辺(t1,t2)を外し、t2の近傍t3との辺を足し、
+// 閉じるためにt3の隣t4との辺を外して(t4,t1)で閉じる (ここまでは2-opt)。
+// 次は今足した(t4,t1)を外す辺として、t4から同じことを LK_DEPTH 段まで続ける。どの段で止めても1つの巡回路になる。
+// 各段は (外した辺 - 足した辺) の累計が正になるt3だけを考え、t4との辺が一番長いものを選ぶ。
+// 1段目だけは近い順に LK_BREADTH 個まで試す。一度足した辺は外さない。
+// 段ごとに実際に繋ぎ替えながら進み、閉じたときの改善が一番大きかった段までを残して後は元に戻す。
+// 改善量を返す (改善しなければ0で経路は元のまま)。繋ぎ替えた町は touched (4 x LK_DEPTH 個まで) に入れる
+static double lk_move(const City *city, int n, int *route, int *pos, const NeighborList *nl,
+                      int t1, int t2, int *touched, int *ntouched)
+{
+  const double eps = 1e-9;
+  int flips[LK_DEPTH][4]; // 適用した繋ぎ替え (t1, t2, t3, t4)
+  int first = 0; // 1段目で次に試す候補
+  for (int breadth = 0 ; breadth < LK_BREADTH ; breadth++){
+    int c2 = t2;
+    double G = dist(city, t1, t2); // 外した辺 - 足した辺 (閉じる辺は含まない)
+    int depth = 0, best_depth = 0;
+    double best_gain = eps;
+    while (depth < LK_DEPTH){
+      const int fwd = (route[(pos[t1] + 1) % n] == c2);
+      const int prev2 = route[(pos[c2] + n - 1) % n], next2 = route[(pos[c2] + 1) % n];
+      int t3 = -1, t4 = -1;
+      double best_g = 0;
+      for (int j = (depth == 0) ? first : 0 ; j < nl->k ; j++){
+        const int c = nl->list[(size_t)c2 * nl->k + j];
+        const double g1 = G - dist(city, c2, c);
+        if (g1 <= eps) break; // 近い順なのでこれ以降も正にならない
+        if (c == prev2 || c == next2) continue;
+        const int d = fwd ? route[(pos[c] + n - 1) % n] : route[(pos[c] + 1) % n];
+        int tabu = 0;
+        for (int f = 0 ; f < depth ; f++){
+          if ((flips[f][1] == c && flips[f][2] == d) || (flips[f][1] == d && flips[f][2] == c)) tabu = 1;
+        }
+        if (tabu) continue;
+        const double g = g1 + dist(city, c, d);
+        if (t3 < 0 || g > best_g){
+          t3 = c; t4 = d; best_g = g;
+        }
+        if (depth == 0){
+          first = j + 1; // 1段目は候補を順に1つずつ
+          break;
+        }
+      }
+      if (t3 < 0){
+        if (depth == 0) return 0; // 1段目の候補がもうない
+        break;
+      }
+      lk_flip(route, pos, n, t1, c2, t3, t4);
+      flips[depth][0] = t1; flips[depth][1] = c2; flips[depth][2] = t3; flips[depth][3] = t4;
+      depth++;
+      G = best_g;
+      const double gain = G - dist(city, t4, t1);
+      if (gain > best_gain){
+        best_gain = gain;
+        best_depth = depth;
+      }
+      c2 = t4;
+    }
+    // 一番よかった段より後を逆順に戻す ((t1,t4,t3,t2) の繋ぎ替えが逆の操作)
+    while (depth > best_depth){
+      depth--;
+      lk_flip(route, pos, n, flips[depth][0], flips[depth][3], flips[depth][2], flips[depth][1]);
+    }
+    if (best_depth > 0){
+      *ntouched = 0;
+      for (int f = 0 ; f < best_depth ; f++){
+        for (int t = 0 ; t < 4 ; t++) touched[(*ntouched)++] = flips[f][t];
+      }
+      return best_gain;
+    }
+  }
+  return 0;
+}
+
+// 待ち行列 w->queue[0..count-1] の町から局所探索をする (pos, queued は呼び出し側で用意する)。
+// 待ち行列から町aを取り出し、aの近くの町とだけ繋ぎ替えを試す。
+// 改善できなければaのbitを立てて(待ち行列から外して)次へ、改善したら関係した町を戻す。
+// 待ち行列が空になったら、改善した距離の合計を返す (経路の回転はしない)
+// deadline (now_sec() の値, 0なら制限なし) を過ぎたら、残りの町の印を消してそこで返す
+static double improve_queue(const City *city, int n, int *route, const NeighborList *nl, Workspace *w, int count,
+                            LocalSearch ls, double deadline)
+{
+  const double eps = 1e-9;
+  int *pos = w->pos;
+  int head = 0, tail = count % n;
+  double total = 0;
+
+  for (long long pops = 1 ; count > 0 ; pops++){
+    if (deadline > 0 && (pops & 1023) == 0 && now_sec() >= deadline){
+      for (int i = 0 ; i < count ; i++) w->queued[w->queue[(head + i) % n]] = 0;
+      break;
+    }
+    const int a = w->queue[head];
+    head = (head + 1) % n;
+    count--;
+    w->queued[a] = 0;
+    int improved = 0;
+
+    // LK: aの後ろと前の辺から可変深さの手を試す (1段目は2-optなので2-optは別にしない)
+    for (int dir = 1 ; ls == LS_LK && dir >= -1 && !improved ; dir -= 2){
+      int touched[4 * LK_DEPTH], nt;
+      const double gain = lk_move(city, n, route, pos, nl, a, route[(pos[a] + dir + n) % n], touched, &nt);
+      if (gain > 0){
+        for (int t = 0 ; t < nt ; t++) push_city(w, n, &tail, &count, touched[t]);
+        total += gain;
+        improved = 1;
+      }
+    }
+
+    // 2-opt: aの後ろ(dir=1)と前(dir=-1)の辺について試す
+    for (int dir = 1 ; ls != LS_LK && dir >= -1 && !improved ; dir -= 2){
+      const int b = route[(pos[a] + dir + n) % n];
+      const double d_ab = dist(city, a, b);
+      for (int t = 0 ; t < nl->k ; t++){
+        const int c = nl->list[(size_t)a * nl->k + t];
+        const double d_ac = dist(city, a, c);
+        if (d_ac >= d_ab) break; // 近い順なのでこれ以降は改善しない
+        const int d = route[(pos[c] + dir + n) % n];
+        if (c == b || d == a) continue;
+        const double delta = d_ac + dist(city, b, d) - d_ab - dist(city, c, d);
+        if (delta < -eps){
+          if (dir == 1) two_opt_move(route, pos, n, a, c);
+          else two_opt_move(route, pos, n, b, d);
+          push_city(w, n, &tail, &count, a); push_city(w, n, &tail, &count, b);
+          push_city(w, n, &tail, &count, c); push_city(w, n, &tail, &count, d);
+          total -= delta;
+          improved = 1;
+          break;
+        }
+      }
+    }
+
+    // Or-opt: aを端とする長さ1~3の区間を、区間の端の近くの辺へ移す
+    for (int L = 1 ; ls != LS_2OPT && !improved && L <= 3 && L + 3 <= n ; L++){
+      for (int dir = 1 ; dir >= -1 && !improved ; dir -= 2){
+        // 区間は位置sから前向きにL個。dir=-1 のときはaが区間の最後になる
+        const int s = (dir == 1) ? pos[a] : (pos[a] - L + 1 + n) % n;
+        const int s1 = route[s], s2 = route[(s + L - 1) % n];
+        const int p = route[(s + n - 1) % n], q = route[(s + L) % n];
+        const double removed = dist(city, p, s1) + dist(city, s2, q)
+          - dist(city, p, q);
+        for (int e = 0 ; e < 2 && !improved ; e++){
+          const int end = (e == 0) ? s1 : s2;
+          for (int t = 0 ; t < nl->k ; t++){
+            const int c = nl->list[(size_t)end * nl->k + t];
+            if (dist(city, end, c) >= removed) break;
+            // cの前後どちらの辺にも入れてみる。(u, v=next u) の形にそろえる
+            for (int side = 0 ; side < 2 ; side++){
+              const int u = (side == 0) ? c : route[(pos[c] + n - 1) % n];
+              const int v = route[(pos[u] + 1) % n];
+              if ((pos[u] - s + n) % n < L || (pos[v] - s + n) % n < L) continue; // 区間内の辺
+              const double d_uv = dist(city, u, v);
+              const double keep = dist(city, u, s1) + dist(city, s2, v) - d_uv;
+              const double flip = dist(city, u, s2) + dist(city, s1, v) - d_uv;
+              const int reversed = (flip < keep);
+              const double delta = (reversed ? flip : keep) - removed;
+              if (delta < -eps){
+                or_opt_move(route, pos, n, s, L, u, reversed);
+                push_city(w, n, &tail, &count, p); push_city(w, n, &tail, &count, q);
+                push_city(w, n, &tail, &count, s1); push_city(w, n, &tail, &count, s2);
+                push_city(w, n, &tail, &count, u); push_city(w, n, &tail, &count, v);
+                total -= delta;
+                improved = 1;
+                break;
               }
-          }//もし新しいルートが前回より短かったらgood_routeをそれに変える。　変更したってわかるようにflag=1にしとく
+            }
+            if (improved) break;
+          }
+        }
       }
+    }
   }
-  
-  if(flag!=0){
-    for(int i=0;i<n;i++){
-      nowroute[i]=good_route[i];
+
+  return total;
+}
+
+// 0番目の町が先頭に来るように route を回転する (w->queue を作業に使う)
+static void rotate_to_zero(int n, int *route, Workspace *w)
+{
+  const int start = w->pos[0];
+  int *tmp = w->queue;
+  for (int i = 0 ; i < n ; i++) tmp[i] = route[(start + i) % n];
+  memcpy(route, tmp, sizeof(int) * n);
+}
+
+// 近傍リスト + don't-look bit による局所探索 (lsは LS_2OPT, LS_OROPT, LS_LK)
+// すべての町を待ち行列に入れて improve_queue し、
+// 0番目の町が先頭になるように回転してrouteに書き戻し、距離を返す。deadline を過ぎたら途中で止める
+double local_search(const City *city, int n, int *route, const NeighborList *nl, Workspace *w, LocalSearch ls,
+                    double deadline)
+{
+  for (int i = 0 ; i < n ; i++){
+    w->pos[route[i]] = i;
+    w->queue[i] = route[i];
+    w->queued[route[i]] = 1;
+  }
+  improve_queue(city, n, route, nl, w, n, ls, deadline);
+  rotate_to_zero(n, route, w);
+  return tour_length(city, n, route);
+}
+
+// 焼きなましの受理判定に使う exp(-x) の表。0 <= x < ACCEPT_RANGE を 1/ACCEPT_SCALE 刻みで持つ
+// 値は (確率 x 2^32) の整数なので、32ビットの乱数と比べるだけで受理するかが決まる (expを呼ばない)
+#define ACCEPT_SCALE 256
+#define ACCEPT_RANGE 16
+static uint32_t accept_table[ACCEPT_SCALE * ACCEPT_RANGE];
+
+// 制限時間がないときの焼きなましの長さ (1都市あたりの移動の候補数)
+#define SA_MOVES_PER_CITY 2000
+
+void init_accept_table(void)
+{
+  for (int i = 0 ; i < ACCEPT_SCALE * ACCEPT_RANGE ; i++){
+    accept_table[i] = (uint32_t)(exp(-(i + 0.5) / ACCEPT_SCALE) * 4294967295.0);
+  }
+}
+
+// 距離が delta (> 0) だけ悪くなる移動を、温度 T = 1 / inv_temp で受理するか (確率 exp(-delta/T))
+static inline int accept_uphill(Rng *r, double delta, double inv_temp)
+{
+  const double x = delta * inv_temp;
+  if (x >= ACCEPT_RANGE) return 0; // exp(-16) = 1e-7 より小さいので受理しない
+  return (uint32_t)(rng_next(r) >> 32) < accept_table[(int)(x * ACCEPT_SCALE)];
+}
+
+// 焼きなましの移動の候補
+typedef struct
+{
+  int oropt;    // 0なら2-opt, 1ならOr-opt
+  int a, c;     // 2-opt: two_opt_move(route, pos, n, a, c)
+  int s, L, u;  // Or-opt: or_opt_move(route, pos, n, s, L, u, reversed)
+  int reversed;
+  double delta; // 距離の変化量
+} SaMove;
+
+// ランダムな町aと、その近傍リストからランダムに選んだ町cを使う移動を作る (適用はしない)
+// local_search と同じ2-opt / Or-opt の形なので、差分は町の数によらずO(1)。作れなければ0を返す
+static int random_move(const City *city, int n, const int *route, const int *pos, const NeighborList *nl,
+                       Rng *r, SaMove *mv)
+{
+  const int a = rng_int(r, n);
+  const int c = nl->list[(size_t)a * nl->k + rng_int(r, nl->k)];
+  const uint64_t bits = rng_next(r);
+  const int dir = (bits & 1) ? 1 : -1;
+  if ((bits & 2) || n < 8){
+    // 2-opt: 辺(a, b)と辺(c, d)を(a, c)と(b, d)に繋ぎ替える (b, dはa, cの同じ側の隣)
+    const int b = route[(pos[a] + dir + n) % n];
+    const int d = route[(pos[c] + dir + n) % n];
+    if (c == b || d == a) return 0;
+    mv->oropt = 0;
+    mv->delta = dist(city, a, c) + dist(city, b, d) - dist(city, a, b) - dist(city, c, d);
+    if (dir == 1){
+      mv->a = a; mv->c = c;
+    } else {
+      mv->a = b; mv->c = d;
     }
-    yama(city,n,good_route,nowroute,min);
-  }//もし上のfor文の中で変更があった場合、こっからさらに最適経路を探せる場合があるので最適経路を探せる場合があるので
-  else {
-    printf("%f ",*min);
-    for(int i=0;i<n;i++){nowroute[i]=good_route[i];
-      printf("%d ",good_route[i]);
+    return 1;
+  }
+  // Or-opt: aを端とする長さ1~3の区間を、辺(c, next c)の間に移す (向きは短くなる方)
+  const int L = 1 + (int)((bits >> 2) % 3);
+  const int s = (dir == 1) ? pos[a] : (pos[a] - L + 1 + n) % n;
+  const int s1 = route[s], s2 = route[(s + L - 1) % n];
+  const int p = route[(s + n - 1) % n], q = route[(s + L) % n];
+  const int u = c, v = route[(pos[c] + 1) % n];
+  if ((pos[u] - s + n) % n < L || (pos[v] - s + n) % n < L) return 0; // 区間内の辺
+  const double removed = dist(city, p, s1) + dist(city, s2, q) - dist(city, p, q);
+  const double d_uv = dist(city, u, v);
+  const double keep = dist(city, u, s1) + dist(city, s2, v) - d_uv;
+  const double flip = dist(city, u, s2) + dist(city, s1, v) - d_uv;
+  mv->oropt = 1;
+  mv->s = s; mv->L = L; mv->u = u;
+  mv->reversed = (flip < keep);
+  mv->delta = (mv->reversed ? flip : keep) - removed;
+  return 1;
+}
+
+// 焼きなまし法。route (solve が Or-opt 付きの局所探索で下りておいた局所最適) から、
+// 悪くなる移動も確率的に受け入れて探す。
+// 温度の決め方:
+//  局所最適のまわりでランダムな移動を試し、悪化量の平均Dを測る (問題の距離の尺度に合わせる)。
+//  初めは平均的な悪化が1/2で受理される T0 = D / ln2、終わりはほとんど受理しない T1 = D / 100。
+//  進み具合 p (経過時間 / 制限時間。制限がなければ 移動の候補数 / (SA_MOVES_PER_CITY x n)) に合わせて
+//  T = T0 (T1/T0)^p と下げるので、制限時間が短くても長くても最後まで冷える
+// 途中の最良経路は w->good_route に覚えておき (4096回ごと)、最後にそれを局所探索で仕上げる。
+// 0番目の町が先頭になるように route に書き戻し、距離を返す。deadline は now_sec() の値 (0なら制限なし)
+double anneal(const City *city, int n, int *route, const NeighborList *nl, Workspace *w, Rng *rng, double deadline)
+{
+  double cur = tour_length(city, n, route);
+  int *pos = w->pos;
+  for (int i = 0 ; i < n ; i++) pos[route[i]] = i;
+  int *best_route = w->good_route;
+  memcpy(best_route, route, sizeof(int) * n);
+  double best = cur;
+
+  double sum = 0;
+  int uphill = 0;
+  for (int t = 0 ; t < 1000 ; t++){
+    SaMove mv;
+    if (random_move(city, n, route, pos, nl, rng, &mv) && mv.delta > 1e-9){
+      sum += mv.delta;
+      uphill++;
+    }
+  }
+  const double D = (uphill > 0) ? sum / uphill : cur / n;
+  const double T0 = D / log(2.0), T1 = D / 100;
+
+  // 近傍リストや最初の局所探索 (solve) で制限時間を使い切っていることもあるので、残り時間は正にしておく
+  const double start = now_sec();
+  const double budget = (deadline > start) ? deadline - start : 1e-9;
+  const long long max_moves = (long long)SA_MOVES_PER_CITY * n;
+  double inv_temp = 1 / T0;
+  for (long long moves = 0 ; ; moves++){
+    if ((moves & 4095) == 0){
+      const double now = now_sec();
+      if (deadline > 0 && now >= deadline) break;
+      const double progress = (deadline > 0) ? (now - start) / budget : (double)moves / max_moves;
+      if (progress >= 1) break;
+      inv_temp = 1 / (T0 * pow(T1 / T0, progress));
+      if (cur < best){
+        best = cur;
+        memcpy(best_route, route, sizeof(int) * n);
+      }
     }
-    printf("\n");
-    
+    SaMove mv;
+    if (!random_move(city, n, route, pos, nl, rng, &mv)) continue;
+    if (mv.delta <= 0 || accept_uphill(rng, mv.delta, inv_temp)){
+      if (mv.oropt) or_opt_move(route, pos, n, mv.s, mv.L, mv.u, mv.reversed);
+      else two_opt_move(route, pos, n, mv.a, mv.c);
+      cur += mv.delta;
+    }
+  }
+  if (cur < best) memcpy(best_route, route, sizeof(int) * n);
+
+  memcpy(route, best_route, sizeof(int) * n);
+  return local_search(city, n, route, nl, w, LS_OROPT, 0);
+}
+
+// キックで入れ替える区間の長さの上限と、制限時間がないときのキックの回数 (1都市あたり)
+#define KICK_SEGMENT 25
+#define LK_KICKS_PER_CITY 2
+
+// 連鎖LK。route (solve が LK の局所探索で下りておいた局所最適) から、次を繰り返す:
+//  ランダムな位置から続く2つの短い区間 B, C を入れ替える (p B C q -> p C B q)。
+//  これは3本の辺を繋ぎ替えるdouble-bridgeで、2-optやLKの手では元に戻せない。区間が短いので O(KICK_SEGMENT)
+//  キックの端の6つの町だけを待ち行列に入れて局所探索し直す (他の町のdon't-look bitはそのまま)。
+//  距離が悪くなっていれば、reverse_range の記録を逆にたどって戻す (同じなら受け入れる)
+// 経路全体のコピーや距離の計算し直しはしないので、1回のキックは都市数にほとんどよらない。
+// 制限時間 (deadline, now_sec() の値) まで、制限がなければ LK_KICKS_PER_CITY x n 回繰り返す。
+// 0番目の町が先頭になるように route に書き戻し、距離を返す
+double chained_lk(const City *city, int n, int *route, const NeighborList *nl, Workspace *w, Rng *rng, double deadline)
+{
+  const double eps = 1e-9;
+  double cur = tour_length(city, n, route);
+  if (n < 8) return cur; // キックを入れる余地がない
+  int *pos = w->pos;
+  for (int i = 0 ; i < n ; i++){
+    pos[route[i]] = i;
+    w->queued[i] = 0;
+  }
+
+  Journal jr = {.rec = NULL, .len = 0, .cap = 0};
+  const int maxlen = (KICK_SEGMENT < (n - 2) / 2) ? KICK_SEGMENT : (n - 2) / 2;
+  const long long kicks = (long long)LK_KICKS_PER_CITY * n;
+  long long accepted = 0, k;
+  for (k = 0 ; deadline > 0 || k < kicks ; k++){
+    if (deadline > 0 && (k & 15) == 0 && now_sec() >= deadline) break;
+    jr.len = 0;
+    journal = &jr;
+
+    const int L1 = 1 + rng_int(rng, maxlen), L2 = 1 + rng_int(rng, maxlen);
+    const int s = rng_int(rng, n);
+    const int p = route[(s + n - 1) % n], b0 = route[s], b1 = route[(s + L1 - 1) % n];
+    const int c0 = route[(s + L1) % n], c1 = route[(s + L1 + L2 - 1) % n], q = route[(s + L1 + L2) % n];
+    const double delta = dist(city, p, c0) + dist(city, c1, b0) + dist(city, b1, q)
+      - dist(city, p, b0) - dist(city, b1, c0) - dist(city, c1, q);
+    reverse_range(route, pos, n, s, L1 + L2);
+    reverse_range(route, pos, n, s, L2);
+    reverse_range(route, pos, n, s + L2, L1);
+
+    const int ends[6] = {p, b0, b1, c0, c1, q};
+    int count = 0;
+    for (int e = 0 ; e < 6 ; e++){
+      if (!w->queued[ends[e]]){
+        w->queued[ends[e]] = 1;
+        w->queue[count++] = ends[e];
+      }
+    }
+    const double next = cur + delta - improve_queue(city, n, route, nl, w, count, LS_LK, 0);
+    journal = NULL;
+    if (next < cur + eps){
+      if (next < cur - eps) accepted++;
+      cur = next;
+    } else {
+      for (size_t r = jr.len ; r > 0 ; r -= 2) reverse_range(route, pos, n, jr.rec[r-2], jr.rec[r-1]);
+    }
+  }
+  free(jr.rec);
+  fprintf(stderr, "chained lk: %lld kicks, %lld improved\n", k, accepted);
+
+  rotate_to_zero(n, route, w);
+  return tour_length(city, n, route);
+}
+
+// 辺 (構築法の候補)
+typedef struct
+{
+  double d2; // 長さの2乗
+  int a, b;
+} Edge;
+
+static int compare_edge(const void *x, const void *y)
+{
+  const Edge *e = (const Edge*)x, *f = (const Edge*)y;
+  if (e->d2 != f->d2) return (e->d2 < f->d2) ? -1 : 1;
+  if (e->a != f->a) return (e->a < f->a) ? -1 : 1;
+  return (e->b > f->b) - (e->b < f->b);
+}
+
+// 貪欲法と最小全域木の候補にする、各町から近いk個への辺 (a < b にそろえ、重複は除く) を短い順に並べる
+#define CAND_K 10
+static Edge *candidate_edges(const City *city, int n, IndexKind index, int *m)
+{
+  SpatialIndex ix = build_index(city, n, index);
+  const NeighborList nl = build_neighbors(&ix, CAND_K);
+  free_index(&ix);
+  Edge *e = (Edge*)malloc(sizeof(Edge) * (size_t)n * nl.k);
+  int cnt = 0;
+  for (int a = 0 ; a < n ; a++){
+    for (int t = 0 ; t < nl.k ; t++){
+      const int b = nl.list[(size_t)a * nl.k + t];
+      if (b < a){
+        // bのリストにもaがあれば、その辺はbのときに入れている
+        int dup = 0;
+        for (int u = 0 ; u < nl.k ; u++) dup |= (nl.list[(size_t)b * nl.k + u] == a);
+        if (dup) continue;
+      }
+      e[cnt++] = (Edge){.d2 = dist2(city[a], city[b]), .a = (a < b) ? a : b, .b = (a < b) ? b : a};
+    }
+  }
+  free(nl.list);
+  qsort(e, cnt, sizeof(Edge), compare_edge);
+  *m = cnt;
+  return e;
+}
+
+// Union-Find (経路を半分に縮める)
+static int uf_find(int *parent, int x)
+{
+  while (parent[x] != x){
+    parent[x] = parent[parent[x]];
+    x = parent[x];
+  }
+  return x;
+}
+
+// 空間索引を使った最近傍の鎖。cand[c] が1の町だけを対象に start から始め、
+// 町xに着いたらその相方 mate[x] (mateがNULLなら x 自身) も訪れたことにして、
+// mate[x] から一番近いまだ訪れていない町へ進む。着いた町を順に order に入れ、その数を返す
+// (相方は、貪欲法でできた道の反対側の端に使う)
+static int nn_chain(const City *city, int n, IndexKind index, const char *cand, const int *mate, int start, int *order)
+{
+  SpatialIndex ix = build_index(city, n, index);
+  for (int c = 0 ; c < n ; c++){
+    if (!cand[c]) index_remove(&ix, c);
+  }
+  int m = 0;
+  for (int cur = start ; cur >= 0 ; ){
+    order[m++] = cur;
+    index_remove(&ix, cur);
+    const int from = (mate != NULL) ? mate[cur] : cur;
+    index_remove(&ix, from);
+    cur = index_nearest(&ix, from);
+  }
+  free_index(&ix);
+  return m;
+}
+
+// 最近傍法。残っている町の中で一番近い町を空間索引で探すので、線形探索の O(n^2) にはならない
+static void nn_tour(const City *city, int n, IndexKind index, int *route)
+{
+  char *cand = (char*)malloc(n);
+  memset(cand, 1, n);
+  nn_chain(city, n, index, cand, NULL, 0, route);
+  free(cand);
+}
+
+// 貪欲法。近いk個への辺だけを短い順に調べ、両端の次数が2未満で閉路にならない辺を採る。
+// 最後に残った道 (と1町だけのもの) は、端から最近傍の鎖で繋ぐ
+static void greedy_tour(const City *city, int n, IndexKind index, int *route)
+{
+  int m;
+  Edge *e = candidate_edges(city, n, index, &m);
+  int *adj = (int*)malloc(sizeof(int) * 2 * n); // 町cの隣は adj[2c], adj[2c+1] (なければ-1)
+  int *parent = (int*)malloc(sizeof(int) * n);
+  for (int c = 0 ; c < n ; c++){
+    adj[2*c] = adj[2*c+1] = -1;
+    parent[c] = c;
+  }
+  for (int i = 0 ; i < m ; i++){
+    const int a = e[i].a, b = e[i].b;
+    if (adj[2*a+1] >= 0 || adj[2*b+1] >= 0) continue; // 次数が2
+    const int ra = uf_find(parent, a), rb = uf_find(parent, b);
+    if (ra == rb) continue; // 閉路になる
+    parent[ra] = rb;
+    adj[2*a + (adj[2*a] >= 0)] = b;
+    adj[2*b + (adj[2*b] >= 0)] = a;
+  }
+  free(e);
+
+  // 道の端 (次数2未満の町) の相方は、道をたどった反対側の端
+  char *end = (char*)calloc(n, 1);
+  int *mate = parent; // もう使わないので使い回す
+  int start = -1;
+  for (int c = 0 ; c < n ; c++){
+    if (adj[2*c+1] >= 0 || end[c]) continue;
+    int prev = -1, cur = c;
+    for (;;){
+      const int next = (adj[2*cur] >= 0 && adj[2*cur] != prev) ? adj[2*cur] : adj[2*cur+1];
+      if (next < 0 || next == prev) break;
+      prev = cur;
+      cur = next;
+    }
+    end[c] = end[cur] = 1;
+    mate[c] = cur;
+    mate[cur] = c;
+    if (start < 0) start = c;
+  }
+  int *order = (int*)malloc(sizeof(int) * n);
+  const int f = nn_chain(city, n, index, end, mate, start, order);
+  // 着いた端から相方の端まで道をたどって経路にする
+  int len = 0;
+  for (int i = 0 ; i < f ; i++){
+    int prev = -1, cur = order[i];
+    for (;;){
+      route[len++] = cur;
+      if (cur == mate[order[i]]) break;
+      const int next = (adj[2*cur] != prev) ? adj[2*cur] : adj[2*cur+1];
+      prev = cur;
+      cur = next;
+    }
+  }
+  assert( len == n );
+  free(order);
+  free(end);
+  free(adj);
+  free(parent);
+}
+
+// 2^16 x 2^16 の格子でのヒルベルト曲線上の番号
+static uint64_t hilbert_key(uint32_t x, uint32_t y)
+{
+  uint64_t d = 0;
+  for (uint32_t s = 1u << 15 ; s > 0 ; s >>= 1){
+    const uint32_t rx = (x & s) > 0, ry = (y & s) > 0;
+    d += (uint64_t)s * s * ((3 * rx) ^ ry);
+    // 象限に合わせて回転する
+    if (ry == 0){
+      if (rx == 1){
+        x = s - 1 - (x & (s - 1));
+        y = s - 1 - (y & (s - 1));
+      }
+      const uint32_t t = x; x = y; y = t;
+    }
+  }
+  return d;
+}
+
+typedef struct
+{
+  uint64_t key;
+  int id;
+} KeyedCity;
+
+static int compare_keyed(const void *x, const void *y)
+{
+  const KeyedCity *a = (const KeyedCity*)x, *b = (const KeyedCity*)y;
+  if (a->key != b->key) return (a->key < b->key) ? -1 : 1;
+  return (a->id > b->id) - (a->id < b->id);
+}
+
+// ヒルベルト曲線の順。町を包む正方形を 2^16 x 2^16 に分け、曲線上の番号で並べ替える (O(n log n))
+static void hilbert_tour(const City *city, int n, int *route)
+{
+  int minx = INT_MAX, maxx = INT_MIN, miny = INT_MAX, maxy = INT_MIN;
+  for (int i = 0 ; i < n ; i++){
+    if (city[i].x < minx) minx = city[i].x;
+    if (city[i].x > maxx) maxx = city[i].x;
+    if (city[i].y < miny) miny = city[i].y;
+    if (city[i].y > maxy) maxy = city[i].y;
+  }
+  const double span = fmax((double)maxx - minx, (double)maxy - miny);
+  const double scale = (span > 0) ? 65535.0 / span : 0;
+  KeyedCity *kc = (KeyedCity*)malloc(sizeof(KeyedCity) * n);
+  for (int i = 0 ; i < n ; i++){
+    kc[i] = (KeyedCity){.key = hilbert_key((uint32_t)(((double)city[i].x - minx) * scale),
+                                           (uint32_t)(((double)city[i].y - miny) * scale)), .id = i};
+  }
+  qsort(kc, n, sizeof(KeyedCity), compare_keyed);
+  for (int i = 0 ; i < n ; i++) route[i] = kc[i].id;
+  free(kc);
+}
+
+// 簡易版Christofides。
+//  1. 近いk個への辺でKruskal法の最小全域木を作る。候補の辺で繋がらなかった部分木は、代表の町を最近傍の鎖で繋ぐ
+//  2. 木で次数が奇数の町を最近傍の鎖の順に2つずつ組にする (最小重みマッチングの代わりの貪欲マッチング)
+//  3. 木とマッチングの辺でできたオイラー閉路をたどり、2度目に来た町を飛ばす
+static void christofides_tour(const City *city, int n, IndexKind index, int *route)
+{
+  int m;
+  Edge *e = candidate_edges(city, n, index, &m);
+  int *parent = (int*)malloc(sizeof(int) * n);
+  for (int c = 0 ; c < n ; c++) parent[c] = c;
+  int *ea = (int*)malloc(sizeof(int) * 2 * n); // 木とマッチングの辺 (ea[2i], ea[2i+1])
+  int ne = 0;
+  for (int i = 0 ; i < m && ne < n - 1 ; i++){
+    const int ra = uf_find(parent, e[i].a), rb = uf_find(parent, e[i].b);
+    if (ra == rb) continue;
+    parent[ra] = rb;
+    ea[2*ne] = e[i].a;
+    ea[2*ne+1] = e[i].b;
+    ne++;
+  }
+  free(e);
+
+  char *cand = (char*)calloc(n, 1);
+  int *order = (int*)malloc(sizeof(int) * n);
+  if (ne < n - 1){
+    int start = -1;
+    for (int c = 0 ; c < n ; c++){
+      if (uf_find(parent, c) == c){
+        cand[c] = 1;
+        if (start < 0) start = c;
+      }
+    }
+    const int f = nn_chain(city, n, index, cand, NULL, start, order);
+    for (int i = 0 ; i + 1 < f ; i++){
+      ea[2*ne] = order[i];
+      ea[2*ne+1] = order[i+1];
+      ne++;
+    }
+  }
+
+  int *deg = (int*)calloc(n, sizeof(int));
+  for (int i = 0 ; i < ne ; i++){
+    deg[ea[2*i]]++;
+    deg[ea[2*i+1]]++;
+  }
+  int start = -1;
+  for (int c = 0 ; c < n ; c++){
+    cand[c] = deg[c] & 1;
+    if (cand[c] && start < 0) start = c;
+  }
+  if (start >= 0){
+    const int f = nn_chain(city, n, index, cand, NULL, start, order);
+    ea = (int*)realloc(ea, sizeof(int) * 2 * (ne + f / 2));
+    for (int i = 0 ; i + 1 < f ; i += 2){
+      ea[2*ne] = order[i];
+      ea[2*ne+1] = order[i+1];
+      ne++;
+    }
+  }
+
+  // 隣接リスト (CSR) を作り、Hierholzer法でオイラー閉路をたどる
+  int *first = (int*)calloc(n + 1, sizeof(int));
+  for (int i = 0 ; i < 2 * ne ; i++) first[ea[i] + 1]++;
+  for (int c = 0 ; c < n ; c++) first[c+1] += first[c];
+  int *fill = (int*)malloc(sizeof(int) * n);
+  memcpy(fill, first, sizeof(int) * n);
+  int *inc = (int*)malloc(sizeof(int) * 2 * ne); // 町ごとの辺の番号
+  for (int i = 0 ; i < ne ; i++){
+    inc[fill[ea[2*i]]++] = i;
+    inc[fill[ea[2*i+1]]++] = i;
+  }
+  char *used = (char*)calloc(ne, 1);
+  int *stack = (int*)malloc(sizeof(int) * (ne + 1));
+  char *seen = cand; // もう使わないので使い回す
+  memset(seen, 0, n);
+  int sp = 0, len = 0;
+  stack[sp++] = 0;
+  memcpy(fill, first, sizeof(int) * n); // fill[c]: 町cの次に調べる辺
+  while (sp > 0){
+    const int v = stack[sp-1];
+    while (fill[v] < first[v+1] && used[inc[fill[v]]]) fill[v]++;
+    if (fill[v] < first[v+1]){
+      const int i = inc[fill[v]];
+      used[i] = 1;
+      stack[sp++] = (ea[2*i] == v) ? ea[2*i+1] : ea[2*i];
+    } else {
+      sp--;
+      if (!seen[v]){
+        seen[v] = 1;
+        route[len++] = v;
+      }
+    }
+  }
+  assert( len == n );
+  free(stack); free(used); free(inc); free(fill); free(first);
+  free(deg); free(order); free(cand); free(ea); free(parent);
+}
+
+void construct_tour(const City *city, int n, InitTour init, IndexKind index, int *route)
+{
+  switch (init){
+  case INIT_NN: nn_tour(city, n, index, route); break;
+  case INIT_GREEDY: greedy_tour(city, n, index, route); break;
+  case INIT_HILBERT: hilbert_tour(city, n, route); break;
+  case INIT_CHRISTOFIDES: christofides_tour(city, n, index, route); break;
+  default:
+    for (int i = 0 ; i < n ; i++) route[i] = i;
+    return;
+  }
+  // 0番目の町が先頭になるように回転する
+  int *tmp = (int*)malloc(sizeof(int) * n);
+  int start = 0;
+  while (route[start] != 0) start++;
+  for (int i = 0 ; i < n ; i++) tmp[i] = route[(start + i) % n];
+  memcpy(route, tmp, sizeof(int) * n);
+  free(tmp);
+}
+
+// 遺伝的アルゴリズムの個体群。親P個と子P個の経路を1つの領域 (arena) に行として並べる。
+// 個体ごとにmallocせず、世代が変わっても行を使い回す (どの行が親かは row で入れ替えるだけでコピーしない)
+typedef struct
+{
+  int size;       // 親の数 P
+  size_t stride;  // 1行の要素数 (行の先頭を64バイト境界にそろえる)
+  int *arena;     // 2P 行
+  int *row;       // row[0..P): 親の行 (短い順), row[P..2P): 子を書く行
+  double *length; // length[r]: r行目の経路の距離
+} Population;
+
+// 制限時間がないとき、最良の個体がこの世代数だけ改善しなければ終わる
+#define GA_STAGNATION 30
+// 子に突然変異 (区間の入れ替え) を入れる確率 (1/GA_MUTATION)
+#define GA_MUTATION 8
+// 最初の世代で、渡された経路に入れるキック (区間の入れ替え) の回数
+#define GA_SEED_KICKS 4
+
+static inline int *pop_route(const Population *pop, int r)
+{
+  return pop->arena + (size_t)r * pop->stride;
+}
+
+// 1スレッド分の子の生成。子 c = P + id, P + id + threads, ... を担当する。
+// 親は読むだけで、書くのは自分の子の行だけなので、スレッド間でロックはいらない。
+// スレッドは最後の世代まで使い続け、世代の区切りは barrier でそろえる
+typedef struct
+{
+  const City *city;
+  int n;
+  const NeighborList *nl;
+  const Config *conf;
+  Population *pop;
+  const int *start; // 最初の世代の0番目の個体にする経路
+  int id;
+  double deadline;  // now_sec() の値 (0なら制限なし)。過ぎたら子を修復しない
+  int first_gen;    // 1なら最初の世代 (交叉せず、start とそれにキックを入れた経路から作る)
+  Rng rng;          // 世代をまたいで使い続ける
+  Workspace w;
+  char *taken;      // 交叉で子に入れた町の印
+  pthread_barrier_t *barrier; // 全スレッド (genetic を呼んだスレッドも含む) で共有
+  const int *done;  // 1なら次の世代はない (barrier を抜けた後に読む)
+} GaWorker;
+
+// 2つ選んで短い方を親にする (トーナメント選択)
+static int pick_parent(const Population *pop, Rng *r)
+{
+  const int a = rng_int(r, pop->size), b = rng_int(r, pop->size);
+  return pop->row[(a < b) ? a : b]; // row は短い順なので番号の小さい方が短い
+}
+
+// 順序交叉 (OX)。親aの区間 [i, j] をそのまま子の同じ位置に写し、
+// 残りの位置には親bの j+1 番目から順に、まだ子にない町を入れていく
+static void order_crossover(int n, const int *a, const int *b, int *child, char *taken, Rng *r)
+{
+  int i = rng_int(r, n), j = rng_int(r, n);
+  if (i > j){
+    const int x = i; i = j; j = x;
+  }
+  memset(taken, 0, n);
+  for (int p = i ; p <= j ; p++){
+    child[p] = a[p];
+    taken[a[p]] = 1;
+  }
+  int q = (j + 1) % n;
+  for (int t = 0 ; t < n ; t++){
+    const int c = b[(j + 1 + t) % n];
+    if (taken[c]) continue;
+    child[q] = c;
+    q = (q + 1) % n;
+  }
+}
+
+// 突然変異: 位置sから続く2つの区間を入れ替える (double-bridge)。tmpはn個分の作業領域
+static void segment_swap(int n, int *route, int *tmp, Rng *r)
+{
+  const int maxlen = (n - 2) / 2;
+  const int L1 = 1 + rng_int(r, maxlen), L2 = 1 + rng_int(r, maxlen);
+  const int s = rng_int(r, n);
+  for (int t = 0 ; t < L1 + L2 ; t++) tmp[t] = route[(s + t) % n];
+  for (int t = 0 ; t < L2 ; t++) route[(s + t) % n] = tmp[L1 + t];
+  for (int t = 0 ; t < L1 ; t++) route[(s + L2 + t) % n] = tmp[t];
+}
+
+// 1世代分の子を作る
+static void ga_generation(GaWorker *g)
+{
+  Population *pop = g->pop;
+  const int n = g->n, P = pop->size;
+  const LocalSearch ls = (g->conf->ls == LS_YAMA) ? LS_2OPT : g->conf->ls;
+  for (int c = P + g->id ; c < 2 * P ; c += g->conf->threads){
+    const int r = pop->row[c];
+    int *child = pop_route(pop, r);
+    // 制限時間を過ぎたら残りの子は作らず空の行 (距離が無限大) のままにする。
+    // ただし最初の世代の0番目は、最良の経路が必ずあるように (途中までの修復で) 作る
+    if (g->deadline > 0 && now_sec() >= g->deadline && !(g->first_gen && c == P)){
+      pop->length[r] = INFINITY;
+      continue;
+    }
+    if (g->first_gen){
+      // 0番目は渡された経路、ほかはそれに GA_SEED_KICKS 回のキックを入れたもの
+      memcpy(child, g->start, sizeof(int) * n);
+      for (int k = 0 ; c != P && n >= 8 && k < GA_SEED_KICKS ; k++) segment_swap(n, child, g->w.queue, &g->rng);
+    } else {
+      const int a = pick_parent(pop, &g->rng);
+      int b = pick_parent(pop, &g->rng);
+      if (b == a) b = pop->row[rng_int(&g->rng, P)];
+      order_crossover(n, pop_route(pop, a), pop_route(pop, b), child, g->taken, &g->rng);
+      if (n >= 8 && rng_int(&g->rng, GA_MUTATION) == 0) segment_swap(n, child, g->w.queue, &g->rng);
+    }
+    // 修復と評価: 局所探索で局所最適にして距離を測る
+    pop->length[r] = local_search(g->city, n, child, g->nl, &g->w, ls, g->deadline);
+  }
+}
+
+// 1番以降のスレッド。世代の始めと終わりに barrier で待ち、done になったら抜ける。
+// ハッシュ表 (距離キャッシュ) は世代をまたいで使い、最後に消す
+static void *ga_worker(void *arg)
+{
+  GaWorker *g = (GaWorker*)arg;
+  for (;;){
+    pthread_barrier_wait(g->barrier);
+    if (*g->done) break;
+    ga_generation(g);
+    pthread_barrier_wait(g->barrier);
+  }
+  free_dist_table();
+  return NULL;
+}
+
+// 親P個と子P個を距離の短い順に並べ、同じ距離のもの (同じ経路とみなす) を除いて上からP個を次の親にする。
+// 重複しかなければ重複からも選ぶ。まだ何も入っていない行 (距離が無限大) は親にしない。
+// 残りの行は次の世代の子を書く行になる
+typedef struct
+{
+  double length;
+  int row;
+} RankedRow;
+
+static int compare_ranked(const void *x, const void *y)
+{
+  const RankedRow *a = (const RankedRow*)x, *b = (const RankedRow*)y;
+  if (a->length != b->length) return (a->length < b->length) ? -1 : 1;
+  return (a->row > b->row) - (a->row < b->row);
+}
+
+static void select_survivors(Population *pop, RankedRow *rk)
+{
+  const int P = pop->size;
+  for (int i = 0 ; i < 2 * P ; i++) rk[i] = (RankedRow){.length = pop->length[pop->row[i]], .row = pop->row[i]};
+  qsort(rk, 2 * P, sizeof(RankedRow), compare_ranked);
+  // 0: 重複していないもの, 1: 重複, 2: 空の行 の順に row に並べ直す
+  int m = 0;
+  for (int group = 0 ; group < 3 ; group++){
+    for (int i = 0 ; i < 2 * P ; i++){
+      const int g = isinf(rk[i].length) ? 2 : (i > 0 && rk[i].length - rk[i-1].length < 1e-7) ? 1 : 0;
+      if (g == group) pop->row[m++] = rk[i].row;
+    }
+  }
+}
+
+// 遺伝的アルゴリズム。
+//  最初の世代は best_route と、それに区間の入れ替えのキックを入れた P-1 個の経路を局所探索で修復したもの。
+//  各世代で、トーナメント選択した2つの親から順序交叉で子をP個作り、ときどき突然変異を入れ、
+//  局所探索 (-l の2-opt/Or-opt/LK。yamaなら2-opt) で修復して距離を測る。
+//  子の生成・修復・評価はまとめて conf->threads 個のスレッド (呼び出したスレッドが0番) に分ける。
+//  スレッドは最初に1回だけ作り、世代ごとに barrier で待ち合わせる (各スレッドは決まった子だけを作るので、
+//  seedとスレッド数が同じなら結果も同じ)。親と子を合わせた中から重複を除いて短いP個を次の親にする。
+//  制限時間まで、制限がなければ最良の個体が GA_STAGNATION 世代改善しなくなるまで続ける。
+//  制限時間を過ぎると修復は途中で止まり、まだ作っていない子は作らない (その世代で終わる)。
+// 最良の経路を best_route に入れ、その距離を返す
+double genetic(const City *city, int n, int *best_route, const NeighborList *nl, const Config *conf, double deadline)
+{
+  const int P = conf->population, T = conf->threads;
+  Population pop = {.size = P, .stride = ((size_t)n + 15) / 16 * 16};
+  pop.arena = (int*)aligned_alloc(64, sizeof(int) * pop.stride * 2 * P);
+  pop.row = (int*)malloc(sizeof(int) * 2 * P);
+  pop.length = (double*)malloc(sizeof(double) * 2 * P);
+  if (pop.arena == NULL){
+    fprintf(stderr, "population: cannot allocate %d x %d routes.\n", 2 * P, n);
+    exit(1);
+  }
+  for (int i = 0 ; i < 2 * P ; i++){
+    pop.row[i] = i;
+    pop.length[i] = INFINITY; // 最初の世代の親の行は空 (子の行に作った個体がそのまま親になる)
+  }
+  RankedRow *rk = (RankedRow*)malloc(sizeof(RankedRow) * 2 * P);
+
+  GaWorker *g = (GaWorker*)malloc(sizeof(GaWorker) * T);
+  pthread_t *th = (pthread_t*)malloc(sizeof(pthread_t) * T);
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, T);
+  int done = 0;
+  for (int t = 0 ; t < T ; t++){
+    g[t] = (GaWorker){.city = city, .n = n, .nl = nl, .conf = conf, .pop = &pop, .start = best_route,
+                      .id = t, .deadline = deadline, .first_gen = 1, .rng = rng_init(conf->seed, t),
+                      .w = init_workspace(n), .taken = (char*)malloc(n), .barrier = &barrier, .done = &done};
+  }
+  for (int t = 1 ; t < T ; t++){
+    if (pthread_create(&th[t], NULL, ga_worker, &g[t]) != 0){
+      fprintf(stderr, "cannot create thread %d.\n", t);
+      exit(1);
+    }
+  }
+
+  double best = INFINITY;
+  int stagnant = 0;
+  for (int gen = 0 ; ; gen++){
+    // 0番はこのスレッドで作る。2回目の barrier を抜けたら全部の子ができている
+    pthread_barrier_wait(&barrier);
+    ga_generation(&g[0]);
+    pthread_barrier_wait(&barrier);
+    select_survivors(&pop, rk);
+    for (int t = 0 ; t < T ; t++) g[t].first_gen = 0;
+
+    const double top = pop.length[pop.row[0]];
+    printf("generation %d: %f (worst parent %f)\n", gen, top, pop.length[pop.row[P-1]]);
+    if (top < best - 1e-9){
+      best = top;
+      stagnant = 0;
+    } else stagnant++;
+    if (deadline > 0 ? now_sec() >= deadline : stagnant >= GA_STAGNATION) break;
+  }
+  done = 1;
+  pthread_barrier_wait(&barrier);
+  for (int t = 1 ; t < T ; t++) pthread_join(th[t], NULL);
+  pthread_barrier_destroy(&barrier);
+  free_dist_table();
+
+  memcpy(best_route, pop_route(&pop, pop.row[0]), sizeof(int) * n);
+  for (int t = 0 ; t < T ; t++){
+    free_workspace(&g[t].w);
+    free(g[t].taken);
   }
+  free(g);
+  free(th);
+  free(rk);
+  free(pop.arena);
+  free(pop.row);
+  free(pop.length);
+  return tour_length(city, n, best_route);
 }
@@ -1,10 +1,18 @@
+// コンパイル: gcc -O2 -pthread tsp_jishu3.c -lm
+// (Held-Karpの表をfloatにしてメモリを半分にしたいときは -DHK_FLOAT を付ける)
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <math.h>
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h> // strtol のエラー判定用
+#include <pthread.h>
+#include "mapfile.h"
+#include <stdatomic.h>
+#include <time.h>
 
 // 町の構造体（今回は2次元座標）を定義
 typedef struct
@@ -27,6 +35,64 @@ typedef struct answer
   int *route;
 }Answer;
 
+// 解き方 (-m オプション)
+typedef enum
+{
+  SOLVE_BB, // 分枝限定法
+  SOLVE_DP, // Held-Karp の動的計画法
+  SOLVE_PAR, // 分枝限定法を部分木ごとにスレッドで分けて並列に
+} SolveMode;
+
+// 探索の葉を書き出す先
+// 全ての葉をprintfすると探索よりも出力の方が遅くなるので、every個に1個だけ書く
+typedef struct
+{
+  FILE *fp;        // NULLなら何も書かない (-q)
+  long long every; // 何個の葉ごとに1個書くか (-e)
+} TraceSink;
+
+typedef struct
+{
+  SolveMode mode;
+  int threads; // 並列に計算するスレッド数
+  TraceSink trace;
+} Config;
+
+// Held-Karp の表の型。既定はdouble。
+// floatなら表が半分の大きさで済むが、差がfloatの精度より小さい経路を取り違えて最適でない答えになることがある
+#ifdef HK_FLOAT
+typedef float hk_t;
+#else
+typedef double hk_t;
+#endif
+
+// 並列探索で全スレッドが共有する暫定解
+// 距離はatomicに読み書きして枝刈りに使い、経路を書き換えるときだけロックする
+typedef struct
+{
+  _Atomic double best;
+  pthread_mutex_t lock;
+  int *best_route;
+} Incumbent;
+
+// 分枝限定法の状態
+// 探索中に見つかった一番短い巡回路(暫定解)を持っておき、
+// 下界がそれ以上になる枝は調べない
+typedef struct
+{
+  Incumbent *shared; // 並列探索のときの共有の暫定解 (1スレッドのときはNULL)
+  const double *dm; // 距離の表 dm[i*n+j]
+  int n;
+  int *order;       // order[i*n+t]: 町iからt番目に近い町 (子を近い順に展開するため)
+  double best;      // 暫定解の距離
+  int *best_route;  // 暫定解の経路
+  double *key;      // 最小全域木を求めるときの作業領域
+  char *in_tree;    // 同上
+  long long nodes;  // 調べた節点の数
+  long long leaves; // 調べた葉の数
+  TraceSink trace;
+} BranchBound;
+
 // 整数最大値をとる関数
 int max(const int a, const int b)
 {
@@ -39,17 +105,32 @@ int max(const int a, const int b)
 // plot_cities: 描画する
 // distance: 2地点間の距離を計算
 // solve(): TSPをといて距離を返す/ 引数route に巡回順を格納
+// solve_bb / solve_dp: 分枝限定法 / Held-Karp の動的計画法 で解く
+// solve_par: 分枝限定法を、探索木の先頭部分(prefix)ごとのタスクに分けてwork-stealingで並列に解く
+// make_distance_matrix: 全ての2町間の距離を n x n の表にしておく (dm[i*n+j])
+// heuristic_route: 最近傍法+2-optで速く作った巡回路 (分枝限定法の最初の暫定解)
+// lower_bound: 残りの町をたどって0番目に戻るのにかかる距離の下界
+// search: 分枝限定法で最短の巡回路を探す
 
 void draw_line(Map map, City a, City b);
-void draw_route(Map map, City *city, int n, const int *route);
-void plot_cities(FILE* fp, Map map, City *city, int n, const int *route);
+void draw_route(Map map, const City *city, int n, const int *route);
+void plot_cities(FILE* fp, Map map, const City *city, int n, const int *route);
 double distance(City a, City b);
-Answer solve(const City *city, int n, int *route, int *visited);
+Answer solve(const City *city, int n, int *route, int *visited, const Config *conf);
+Answer solve_bb(const City *city, int n, int *route, int *visited, const Config *conf);
+Answer solve_dp(const City *city, int n, int *route, int threads);
+Answer solve_par(const City *city, int n, int *route, const Config *conf);
+int load_int(const char *argvalue);
 Map init_map(const int width, const int height);
 void free_map_dot(Map m);
-City *load_cities(const char* filename,int *n,const int max_cities);
-Answer search(int index, const City *city, int n, int *route,double demo_distance, int *visited, int *flags, double sum_v);
+// 町のファイル(従来の形式かバージョン付きの形式)をmmapして、要素をそのままCityの配列として使う (コピーしない)
+//  使い終わったら unmap_file(file) する
+const City *load_cities(const char* filename,int *n,const int max_cities,MappedFile *file);
+void search(int index, BranchBound *bb, int *route, int *visited, double sum_d);
 double sum_distance(int n, int *route,const City *city);
+double *make_distance_matrix(const City *city, int n);
+double heuristic_route(const double *dm, int n, int *route);
+double lower_bound(BranchBound *bb, const int *visited, int last);
 
 
 
@@ -67,24 +148,33 @@ void free_map_dot(Map m)
   free(m.dot);
 }
 
-City *load_cities(const char *filename, int *n,const int max_cities)
+const City *load_cities(const char *filename, int *n,const int max_cities,MappedFile *file)
+{
+  // 従来の形式でもバージョン付きの形式でも、要素の並び (x_0, y_0, x_1, y_1, ...) はCityの配列と同じ
+  uint64_t count;
+  int legacy;
+  const City *city = (const City*)map_instance(filename, BIN_CITY_I32, file, &count, NULL, NULL, &legacy);
+  assert( count <= (uint64_t)max_cities );
+  *n = (int)count;
+  return city;
+}
+int load_int(const char *argvalue)
 {
-  City *city;
-  FILE *fp;
-  if ((fp=fopen(filename,"rb")) == NULL){
-    fprintf(stderr, "%s: cannot open file.\n",filename);
+  long nl;
+  char *e;
+  errno = 0; // errno.h で定義されているグローバル変数を一旦初期化
+  nl = strtol(argvalue,&e,10);
+  if (errno == ERANGE){
+    fprintf(stderr,"%s: %s\n",argvalue,strerror(errno));
     exit(1);
   }
-  fread(n,sizeof(int),1,fp);
-  assert( *n <= max_cities ); 
-  city = (City*)malloc(sizeof(City) * *n);
-  for (int i = 0 ; i < *n ; i++){
-    fread(&city[i].x, sizeof(int), 1, fp);
-    fread(&city[i].y, sizeof(int), 1, fp);
+  if (*e != '\0'){
+    fprintf(stderr,"%s: an irregular character '%c' is detected.\n",argvalue,*e);
+    exit(1);
   }
-  fclose(fp);
-  return city;
+  return (int)nl;
 }
+
 int main(int argc, char**argv)
 {
   // const による定数定義
@@ -95,13 +185,47 @@ int main(int argc, char**argv)
   Map map = init_map(width, height);
   
   FILE *fp = stdout; // とりあえず描画先は標準出力としておく
-  if (argc != 2){
-    fprintf(stderr, "Usage: %s <city file>\n", argv[0]);
+  const char *usage = "Usage: %s [-m bb|dp|par] [-t threads] [-q] [-e every] <city file>\n";
+  // 既定では今まで通り全ての葉を標準出力に書く
+  Config conf = {.mode = SOLVE_BB, .threads = (int)sysconf(_SC_NPROCESSORS_ONLN),
+                 .trace = {.fp = stdout, .every = 1}};
+  int opt;
+  while ((opt = getopt(argc, argv, "m:t:qe:")) != -1){
+    switch (opt){
+    case 'm':
+      if (strcmp(optarg, "bb") == 0) conf.mode = SOLVE_BB;
+      else if (strcmp(optarg, "dp") == 0) conf.mode = SOLVE_DP;
+      else if (strcmp(optarg, "par") == 0) conf.mode = SOLVE_PAR;
+      else {
+        fprintf(stderr, "%s: unknown solve mode.\n", optarg);
+        exit(1);
+      }
+      break;
+    case 't':
+      conf.threads = load_int(optarg);
+      assert( conf.threads > 0 );
+      break;
+    case 'q':
+      conf.trace.fp = NULL;
+      break;
+    case 'e':
+      conf.trace.every = load_int(optarg);
+      assert( conf.trace.every > 0 );
+      break;
+    default:
+      fprintf(stderr, usage, argv[0]);
+      exit(1);
+    }
+  }
+  if (argc - optind != 1){
+    fprintf(stderr, usage, argv[0]);
     exit(1);
   }
+  if (conf.threads < 1) conf.threads = 1;
   int n;
 
-  City *city = load_cities(argv[1],&n,max_cities);
+  MappedFile file;
+  const City *city = load_cities(argv[optind],&n,max_cities,&file);
 
   // 町の初期配置を表示
   plot_cities(fp, map, city, n, NULL);
@@ -112,7 +236,7 @@ int main(int argc, char**argv)
   // 訪れた町を記録するフラグ
   int *visited = (int*)calloc(n, sizeof(int));
 
-  Answer answer= solve(city,n,route,visited);//ここにsolveあるよおおおおおお
+  Answer answer= solve(city,n,route,visited,&conf);//ここにsolveあるよおおおおおお
   double d=answer.count_distance;
   plot_cities(fp, map, city, n, answer.route);
   printf("total distance = %f\n", d);
@@ -124,7 +248,7 @@ int main(int argc, char**argv)
   // 動的確保した環境ではfreeをする
   free(route);
   free(visited);
-  free(city);
+  unmap_file(&file);
   
   return 0;
 }
@@ -140,7 +264,7 @@ void draw_line(Map map, City a, City b)
   }
 }
 
-void draw_route(Map map, City *city, int n, const int *route)
+void draw_route(Map map, const City *city, int n, const int *route)
 {
   if (route == NULL) return;
 
@@ -151,7 +275,7 @@ void draw_route(Map map, City *city, int n, const int *route)
   }
 }
 
-void plot_cities(FILE *fp, Map map, City *city, int n, const int *route)
+void plot_cities(FILE *fp, Map map, const City *city, int n, const int *route)
 {
   fprintf(fp, "----------\n");
 
@@ -187,32 +311,401 @@ double distance(City a, City b)
   return sqrt(dx * dx + dy * dy);
 }
 
-Answer solve(const City *city, int n, int *route, int *visited)//nはcityの数
+Answer solve(const City *city, int n, int *route, int *visited, const Config *conf)//nはcityの数
+{
+  switch (conf->mode){
+  case SOLVE_DP:
+    return solve_dp(city, n, route, conf->threads);
+  case SOLVE_PAR:
+    return solve_par(city, n, route, conf);
+  default:
+    return solve_bb(city, n, route, visited, conf);
+  }
+}
+
+// 近い順の表・作業領域・最初の暫定解を用意する
+static void init_branch_bound(BranchBound *bb, const double *dm, int n)
+{
+  *bb = (BranchBound){.shared = NULL, .dm = dm, .n = n, .nodes = 0, .leaves = 0};
+  int *order = (int*)malloc(sizeof(int) * n * n);
+  bb->key = (double*)malloc(sizeof(double) * n);
+  bb->in_tree = (char*)malloc(sizeof(char) * n);
+  bb->best_route = (int*)malloc(sizeof(int) * n);
+
+  // 各町から近い順に並べておく (挿入ソート, nは小さいのでこれで十分)
+  for (int i = 0 ; i < n ; i++){
+    int *o = order + i*n;
+    for (int j = 0 ; j < n ; j++){
+      int p = j;
+      while (p > 0 && dm[i*n + o[p-1]] > dm[i*n + j]){
+        o[p] = o[p-1];
+        p--;
+      }
+      o[p] = j;
+    }
+  }
+  bb->order = order;
+
+  // 最初の暫定解。これより長い枝は最初から切れる
+  bb->best = heuristic_route(dm, n, bb->best_route);
+}
+
+static void free_branch_bound(BranchBound *bb)
+{
+  free(bb->best_route);
+  free(bb->order);
+  free(bb->key);
+  free(bb->in_tree);
+}
+
+// 経過時間 (秒)
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 探索の速さを標準エラーに書く
+static void report_search(const char *name, long long nodes, long long leaves, double sec)
+{
+  fprintf(stderr, "%s: %lld nodes, %lld leaves in %.3f s (%.0f leaves/s)\n",
+          name, nodes, leaves, sec, (sec > 0) ? leaves / sec : 0.0);
+}
+
+Answer solve_bb(const City *city, int n, int *route, int *visited, const Config *conf)
 {
-  // 以下はとりあえずダミー。ここに探索プログラムを実装する
-  // 現状は町の番号順のルートを回っているだけ
-  // 実際は再帰的に探索して、組み合わせが膨大になる。
   route[0] = 0; // 循環した結果を避けるため、常に0番目からスタート
   visited[0] = 1;
-    for (int i = 1; i < n ; i++){
+  for (int i = 1; i < n ; i++){
     visited[i] = 0; // 訪問済みでないことを0で初期化
   }
-  int *demo_route = (int*)calloc(n, sizeof(int));
-  demo_route[0] = 0; 
-  for (int i = 0 ; i < n ; i++){
-    demo_route[i] = i; // 訪問済みかチェック
+  // 探索中は同じ組の距離を何度も使うので、sqrtは最初にまとめて計算しておく
+  double *dm = make_distance_matrix(city, n);
+
+  BranchBound bb;
+  init_branch_bound(&bb, dm, n);
+  bb.trace = conf->trace;
+  const double start = now_sec();
+  search(1, &bb, route, visited, 0.0);
+  report_search("branch and bound", bb.nodes, bb.leaves, now_sec() - start);
+
+  const double best = bb.best;
+  memcpy(route, bb.best_route, sizeof(int) * n);
+  free_branch_bound(&bb);
+  free(dm);
+  return (Answer){.count_distance = best, .route = route};
+}
+
+// 並列探索の1タスク: 0番目から始まる長さdepth+1の経路の先頭部分
+typedef struct
+{
+  int *prefix;
+  double sum_d;
+} PrefixTask;
+
+// work-stealing 用の両端キュー
+// 持ち主は後ろ(bottom)から取り、他のスレッドは前(top)から盗む
+typedef struct
+{
+  pthread_mutex_t lock;
+  int *task; // タスクの番号
+  int top;
+  int bottom;
+} TaskDeque;
+
+typedef struct
+{
+  int id;
+  int threads;
+  int depth;
+  const PrefixTask *tasks;
+  TaskDeque *deques;
+  BranchBound bb; // order, dm は共有, key, in_tree はスレッドごと
+} ParWorker;
+
+// 自分のキューの後ろから取る。空なら他のスレッドのキューの前から盗む。全部空なら-1
+static int next_task(ParWorker *pw)
+{
+  for (int k = 0 ; k < pw->threads ; k++){
+    TaskDeque *q = &pw->deques[(pw->id + k) % pw->threads];
+    int t = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->top < q->bottom) t = (k == 0) ? q->task[--q->bottom] : q->task[q->top++];
+    pthread_mutex_unlock(&q->lock);
+    if (t >= 0) return t;
+  }
+  return -1;
+}
+
+static void *par_worker(void *arg)
+{
+  ParWorker *pw = (ParWorker*)arg;
+  const int n = pw->bb.n;
+  int *route = (int*)malloc(sizeof(int) * n);
+  int *visited = (int*)malloc(sizeof(int) * n);
+  int t;
+  while ((t = next_task(pw)) >= 0){
+    const PrefixTask *task = &pw->tasks[t];
+    for (int i = 0 ; i < n ; i++) visited[i] = 0;
+    for (int i = 0 ; i <= pw->depth ; i++){
+      route[i] = task->prefix[i];
+      visited[route[i]] = 1;
+    }
+    search(pw->depth + 1, &pw->bb, route, visited, task->sum_d);
   }
-  double demo_distance=sum_distance(n,demo_route,city);
-  free(demo_route);//枝切りの基準となるdemo_distanceを作る。これより長かったら切る。
+  free(route);
+  free(visited);
+  return NULL;
+}
 
-  int *flags = (int*)calloc(n, sizeof(int));
+// 先頭depth+1個を決めた経路を近い順に全て列挙する (最初の暫定解で切れるものは除く)
+static void make_prefixes(const BranchBound *bb, int depth, int index, int *route, int *visited,
+                          double sum_d, PrefixTask *tasks, int *count, int *pool)
+{
+  const int n = bb->n;
+  if (index == depth + 1){
+    PrefixTask *task = &tasks[*count];
+    task->prefix = pool + (size_t)(*count) * (depth + 1);
+    memcpy(task->prefix, route, sizeof(int) * (depth + 1));
+    task->sum_d = sum_d;
+    (*count)++;
+    return;
+  }
+  const int last = route[index-1];
+  for (int t = 0 ; t < n ; t++){
+    const int i = bb->order[last*n + t];
+    if (visited[i]) continue;
+    const double next_d = sum_d + bb->dm[last*n + i];
+    if (next_d + bb->dm[i*n] >= bb->best - 1e-9) continue;
+    route[index] = i;
+    visited[i] = 1;
+    make_prefixes(bb, depth, index + 1, route, visited, next_d, tasks, count, pool);
+    visited[i] = 0;
+  }
+}
 
-  Answer shortest = search(1, city,  n, route,demo_distance, visited, flags, 0.0);
-  
-  free(flags);
-  return shortest;
+Answer solve_par(const City *city, int n, int *route, const Config *conf)
+{
+  const int threads = conf->threads;
+  double *dm = make_distance_matrix(city, n);
+  BranchBound root;
+  init_branch_bound(&root, dm, n);
+
+  // スレッドあたり64個くらいのタスクができる深さまで先頭を固定する
+  int depth = 0;
+  size_t ntasks = 1;
+  while (depth < n - 2 && ntasks < (size_t)threads * 64){
+    depth++;
+    ntasks *= (size_t)(n - depth);
+  }
+  PrefixTask *tasks = (PrefixTask*)malloc(sizeof(PrefixTask) * ntasks);
+  int *pool = (int*)malloc(sizeof(int) * ntasks * (depth + 1));
+  int *visited = (int*)calloc(n, sizeof(int));
+  int count = 0;
+  route[0] = 0;
+  visited[0] = 1;
+  if (depth > 0) make_prefixes(&root, depth, 1, route, visited, 0.0, tasks, &count, pool);
+  else {
+    tasks[0] = (PrefixTask){.prefix = pool, .sum_d = 0.0};
+    pool[0] = 0;
+    count = 1;
+  }
+  free(visited);
 
-  
+  Incumbent inc = {.best_route = root.best_route};
+  atomic_init(&inc.best, root.best);
+  pthread_mutex_init(&inc.lock, NULL);
+
+  // タスクは近い順に並んでいるので、順番に各スレッドへ配る
+  TaskDeque *deques = (TaskDeque*)malloc(sizeof(TaskDeque) * threads);
+  for (int t = 0 ; t < threads ; t++){
+    pthread_mutex_init(&deques[t].lock, NULL);
+    deques[t].task = (int*)malloc(sizeof(int) * (count / threads + 1));
+    deques[t].top = deques[t].bottom = 0;
+  }
+  // 持ち主は後ろから取るので、良さそうなタスクほど後ろに置く
+  for (int k = count - 1 ; k >= 0 ; k--){
+    TaskDeque *q = &deques[k % threads];
+    q->task[q->bottom++] = k;
+  }
+
+  const double start = now_sec();
+  ParWorker *pw = (ParWorker*)malloc(sizeof(ParWorker) * threads);
+  pthread_t *th = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+  for (int t = 0 ; t < threads ; t++){
+    pw[t] = (ParWorker){.id = t, .threads = threads, .depth = depth, .tasks = tasks, .deques = deques};
+    pw[t].bb = (BranchBound){.shared = &inc, .dm = dm, .n = n, .order = root.order,
+                             .best = root.best, .best_route = NULL,
+                             .key = (double*)malloc(sizeof(double) * n),
+                             .in_tree = (char*)malloc(sizeof(char) * n), .nodes = 0,
+                             .leaves = 0, .trace = conf->trace};
+    if (pthread_create(&th[t], NULL, par_worker, &pw[t]) != 0){
+      fprintf(stderr, "cannot create thread %d.\n", t);
+      exit(1);
+    }
+  }
+  long long nodes = 0, leaves = 0;
+  for (int t = 0 ; t < threads ; t++){
+    pthread_join(th[t], NULL);
+    nodes += pw[t].bb.nodes;
+    leaves += pw[t].bb.leaves;
+    free(pw[t].bb.key);
+    free(pw[t].bb.in_tree);
+  }
+  fprintf(stderr, "parallel branch and bound: %d tasks (depth %d), %d threads\n", count, depth, threads);
+  report_search("parallel branch and bound", nodes, leaves, now_sec() - start);
+
+  const double best = atomic_load(&inc.best);
+  memcpy(route, inc.best_route, sizeof(int) * n);
+  for (int t = 0 ; t < threads ; t++){
+    pthread_mutex_destroy(&deques[t].lock);
+    free(deques[t].task);
+  }
+  pthread_mutex_destroy(&inc.lock);
+  free(deques);
+  free(pw);
+  free(th);
+  free(tasks);
+  free(pool);
+  free_branch_bound(&root);
+  free(dm);
+  return (Answer){.count_distance = best, .route = route};
+}
+
+// Held-Karp の1層分をスレッドで分けて計算するための引数
+typedef struct
+{
+  hk_t *dp;
+  const hk_t *dh; // 0番目以外の町どうしの距離 dh[i*m+j] (町i+1と町j+1)
+  int m;          // 0番目以外の町の数
+  int layer;      // この層で埋める集合の要素数
+  uint32_t begin, end; // 担当する集合の範囲
+} HkTask;
+
+// dp[mask*m + j]: 0番目を出発し、maskの町を全て1回ずつ回って町j+1にいるときの最短距離
+// 要素数layerの集合は、要素数layer-1の集合だけから求まるので、層の中では並列に計算できる
+static void *hk_layer(void *arg)
+{
+  const HkTask *t = (const HkTask*)arg;
+  const int m = t->m;
+  for (uint32_t mask = t->begin ; mask < t->end ; mask++){
+    if (__builtin_popcount(mask) != t->layer) continue;
+    hk_t *row = t->dp + (size_t)mask * m;
+    for (int j = 0 ; j < m ; j++){
+      if (!(mask >> j & 1)) continue;
+      const hk_t *prev = t->dp + (size_t)(mask ^ (1u << j)) * m;
+      hk_t best = INFINITY;
+      for (int i = 0 ; i < m ; i++){
+        if (i == j || !(mask >> i & 1)) continue;
+        const hk_t v = prev[i] + t->dh[i*m + j];
+        if (v < best) best = v;
+      }
+      row[j] = best;
+    }
+  }
+  return NULL;
+}
+
+// Held-Karp の動的計画法。O(2^n n^2) 時間, O(2^n n) メモリ
+// 表は集合ごとにm個の値を並べた1本の配列にして、同じ集合の値が連続するようにしている
+Answer solve_dp(const City *city, int n, int *route, int threads)
+{
+  const int m = n - 1;
+  if (m < 1 || m > 30){
+    fprintf(stderr, "Held-Karp: %d cities is out of range (2..31).\n", n);
+    exit(1);
+  }
+  const uint32_t full = 1u << m;
+  const size_t cells = (size_t)full * m;
+  fprintf(stderr, "Held-Karp: 2^%d x %d table of %s = %.1f MB\n",
+          m, m, (sizeof(hk_t) == sizeof(float)) ? "float" : "double",
+          cells * sizeof(hk_t) / (1024.0 * 1024.0));
+  hk_t *dp = (hk_t*)malloc(sizeof(hk_t) * cells);
+  if (dp == NULL){
+    fprintf(stderr, "Held-Karp: cannot allocate the table.\n");
+    exit(1);
+  }
+
+  double *dm = make_distance_matrix(city, n);
+  hk_t *dh = (hk_t*)malloc(sizeof(hk_t) * m * m);
+  for (int i = 0 ; i < m ; i++){
+    for (int j = 0 ; j < m ; j++) dh[i*m + j] = (hk_t)dm[(i+1)*n + (j+1)];
+  }
+  for (int j = 0 ; j < m ; j++) dp[(size_t)(1u << j) * m + j] = (hk_t)dm[j+1];
+
+  // 小さな問題ではスレッドを作る方が高くつく
+  if (m < 16) threads = 1;
+  HkTask *task = (HkTask*)malloc(sizeof(HkTask) * threads);
+  pthread_t *th = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+  for (int layer = 2 ; layer <= m ; layer++){
+    for (int t = 0 ; t < threads ; t++){
+      task[t] = (HkTask){.dp = dp, .dh = dh, .m = m, .layer = layer,
+                         .begin = (uint32_t)((uint64_t)full * t / threads),
+                         .end = (uint32_t)((uint64_t)full * (t+1) / threads)};
+    }
+    if (threads == 1){
+      hk_layer(&task[0]);
+      continue;
+    }
+    for (int t = 0 ; t < threads ; t++){
+      if (pthread_create(&th[t], NULL, hk_layer, &task[t]) != 0){
+        fprintf(stderr, "cannot create thread %d.\n", t);
+        exit(1);
+      }
+    }
+    for (int t = 0 ; t < threads ; t++) pthread_join(th[t], NULL);
+  }
+  free(task);
+  free(th);
+
+  // 最後の町を決め、そこから1つ前の町を順にたどって経路を復元する
+  uint32_t mask = full - 1;
+  int cur = -1;
+  hk_t best = INFINITY;
+  for (int j = 0 ; j < m ; j++){
+    const hk_t v = dp[(size_t)mask * m + j] + (hk_t)dm[(j+1)*n];
+    if (v < best){
+      best = v;
+      cur = j;
+    }
+  }
+  route[0] = 0;
+  for (int p = n - 1 ; p >= 1 ; p--){
+    route[p] = cur + 1;
+    const uint32_t prev_mask = mask ^ (1u << cur);
+    int prev = -1;
+    hk_t pbest = INFINITY;
+    for (int i = 0 ; i < m ; i++){
+      if (!(prev_mask >> i & 1)) continue;
+      const hk_t v = dp[(size_t)prev_mask * m + i] + dh[i*m + cur];
+      if (v < pbest){
+        pbest = v;
+        prev = i;
+      }
+    }
+    mask = prev_mask;
+    cur = prev;
+  }
+
+  // 表がfloatでも、答えの距離はdoubleで計算し直す
+  double sum_d = 0;
+  for (int i = 0 ; i < n ; i++) sum_d += dm[route[i]*n + route[(i+1)%n]];
+  free(dh);
+  free(dm);
+  free(dp);
+  return (Answer){.count_distance = sum_d, .route = route};
+}
+
+double *make_distance_matrix(const City *city, int n)
+{
+  double *dm = (double*)malloc(sizeof(double) * n * n);
+  for (int i = 0 ; i < n ; i++){
+    for (int j = 0 ; j < n ; j++){
+      dm[i*n + j] = distance(city[i], city[j]);
+    }
+  }
+  return dm;
 }
 
 double sum_distance(int n, int *route,const City *city){
@@ -227,45 +720,139 @@ double sum_distance(int n, int *route,const City *city){
   return sum_d;
 }
 
-Answer  search(int index, const City *city, int n, int *route, double demo_distance ,int *visited, int *flags, double sum_d)
-{ 
-  int max_index = n;
-  assert(index >= 0 && sum_d >= 0);
-  // 必ず再帰の停止条件を明記する (最初が望ましい)
-  if (index == max_index){
-    const char *format_ok = ", total_value = %5.1f\n";
-    for (int i = 0 ; i < max_index ; i++){
-      printf("%d", route[i]);
+// 0番目から一番近い未訪問の町へ進んでいき、できた巡回路を2-optで改善する
+double heuristic_route(const double *dm, int n, int *route)
+{
+  char *used = (char*)calloc(n, sizeof(char));
+  route[0] = 0;
+  used[0] = 1;
+  for (int i = 1 ; i < n ; i++){
+    int next = -1;
+    for (int j = 0 ; j < n ; j++){
+      if (!used[j] && (next < 0 || dm[route[i-1]*n + j] < dm[route[i-1]*n + next])) next = j;
+    }
+    route[i] = next;
+    used[next] = 1;
+  }
+  free(used);
+
+  int improved = 1;
+  while (improved){
+    improved = 0;
+    for (int i = 0 ; i < n - 2 ; i++){
+      for (int j = i + 2 ; j < n ; j++){
+        const int a = route[i], b = route[i+1], c = route[j], d = route[(j+1)%n];
+        if (a == d) continue;
+        if (dm[a*n+c] + dm[b*n+d] < dm[a*n+b] + dm[c*n+d] - 1e-9){
+          for (int l = i + 1, r = j ; l < r ; l++, r--){
+            const int x = route[l]; route[l] = route[r]; route[r] = x;
+          }
+          improved = 1;
+        }
+      }
     }
+  }
 
-      printf(format_ok, sum_d);
+  double sum_d = 0;
+  for (int i = 0 ; i < n ; i++) sum_d += dm[route[i]*n + route[(i+1)%n]];
+  return sum_d;
+}
 
-      char *flags_char= (char*)malloc(sizeof(char)*100);
-      for (int i = 0 ; i < max_index ; i++){
-        flags_char[i]=route[i];
+// 今いる町lastから未訪問の町を全てたどって0番目に戻る道は、
+// {last, 0, 未訪問の町} を結ぶ全域木になっているので、その最小全域木の重さは下界になる。
+// Prim法でO(m^2) (mは残りの町の数)
+double lower_bound(BranchBound *bb, const int *visited, int last)
+{
+  const int n = bb->n;
+  const double *dm = bb->dm;
+  double *key = bb->key;
+  char *in_tree = bb->in_tree;
+  int m = 0;
+  for (int i = 0 ; i < n ; i++){
+    in_tree[i] = (visited[i] && i != last && i != 0); // 木に入れない町は最初から入ったことにする
+    if (!in_tree[i]) m++;
+    key[i] = dm[last*n + i];
+  }
+  in_tree[last] = 1;
+  double total = 0;
+  for (int t = 1 ; t < m ; t++){
+    int u = -1;
+    for (int i = 0 ; i < n ; i++){
+      if (!in_tree[i] && (u < 0 || key[i] < key[u])) u = i;
+    }
+    in_tree[u] = 1;
+    total += key[u];
+    for (int i = 0 ; i < n ; i++){
+      if (!in_tree[i] && dm[u*n + i] < key[i]) key[i] = dm[u*n + i];
     }
-
-      return (Answer){ .count_distance = sum_d + distance(city[route[max_index]],city[route[0]]), .route=route};
-    
   }
+  return total;
+}
 
-  // 以下は再帰の更新式: 現在のindex の品物を使う or 使わないで分岐し、index をインクリメントして再帰的にsearch() を実行する
-  
-  Answer tmp= (Answer){ .count_distance = demo_distance*2};
-  
+// 今の暫定解の距離 (並列探索では他のスレッドが見つけたものも含む)
+static inline double incumbent(const BranchBound *bb)
+{
+  return bb->shared ? atomic_load_explicit(&bb->shared->best, memory_order_relaxed) : bb->best;
+}
 
-  for (int i =1; i<n; i++){
-    if (visited[i]==0){
-      route[index] = i;
-      visited[i]=1;
-      Answer rrr=search(index+1, city,  n, route,demo_distance, visited, flags, sum_d + distance(city[route[index-1]],city[route[index]]));
-      
-      if(rrr.count_distance<tmp.count_distance){
-        tmp=rrr;
-      }
-      visited[i]=0;
+// 葉: 全ての町を回ったので、0番目に戻る辺を足して暫定解と比べる
+// 葉ではmallocもしない。書き出すのはtraceで選ばれた葉だけ
+static void visit_leaf(BranchBound *bb, const int *route, double sum_d)
+{
+  const int n = bb->n;
+  const double total = sum_d + bb->dm[route[n-1]*n + route[0]];
+  bb->leaves++;
+  if (bb->trace.fp != NULL && bb->leaves % bb->trace.every == 0){
+    FILE *fp = bb->trace.fp;
+    flockfile(fp); // 並列探索で他のスレッドの行と混ざらないように
+    for (int i = 0 ; i < n ; i++){
+      fprintf(fp, "%d", route[i]);
+    }
+    fprintf(fp, ", total_value = %5.1f\n", total);
+    funlockfile(fp);
+  }
+
+  if (bb->shared != NULL){
+    Incumbent *inc = bb->shared;
+    if (total >= incumbent(bb)) return;
+    pthread_mutex_lock(&inc->lock);
+    if (total < atomic_load(&inc->best)){
+      memcpy(inc->best_route, route, sizeof(int) * n);
+      atomic_store(&inc->best, total);
     }
-    
+    pthread_mutex_unlock(&inc->lock);
+  } else if (total < bb->best){
+    bb->best = total;
+    memcpy(bb->best_route, route, sizeof(int) * n);
   }
-  return  tmp;
-}   
\ No newline at end of file
+}
+
+void search(int index, BranchBound *bb, int *route, int *visited, double sum_d)
+{
+  const int n = bb->n;
+  const double *dm = bb->dm;
+  assert(index >= 0 && sum_d >= 0);
+  bb->nodes++;
+  // 必ず再帰の停止条件を明記する (最初が望ましい)
+  if (index == n){
+    visit_leaf(bb, route, sum_d);
+    return;
+  }
+
+  // 限定: ここまでの距離 + 残りの下界 が暫定解以上なら、この先に暫定解より短い巡回路はない
+  const int last = route[index-1];
+  if (sum_d + lower_bound(bb, visited, last) >= incumbent(bb) - 1e-9) return;
+
+  // 分枝: 今いる町から近い順に次の町を選ぶ (早く良い暫定解が見つかるほど枝が切れる)
+  const int *order = bb->order + last*n;
+  for (int t = 0 ; t < n ; t++){
+    const int i = order[t];
+    if (visited[i]) continue;
+    const double next_d = sum_d + dm[last*n + i];
+    if (next_d + dm[i*n] >= incumbent(bb) - 1e-9) continue; // すぐ0番目に戻っても暫定解を超える
+    route[index] = i;
+    visited[i]=1;
+    search(index+1, bb, route, visited, next_d);
+    visited[i]=0;
+  }
+}